@@ -0,0 +1,126 @@
+/* Per-core thermal steering.
+ *
+ * Rather than suspending the whole job when one core runs hot, each core
+ * with its own temperature sensor gets its own hot/cool hysteresis: while
+ * it is hot, every thread of the job is moved off that core's logical
+ * CPUs with sched_setaffinity(), and allowed back once it has cooled.
+ * Only when every core is too hot does whole-job control take over.
+ *
+ * Cores are identified by topology/core_id, so on a multi-package
+ * machine a hot core also steers the job off the same core id on the
+ * other packages; that errs on the side of caution.
+ */
+#define _GNU_SOURCE
+#include "krun.h"
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_CORES 1024
+
+const char* cpu_root = "/sys/devices/system/cpu";
+
+static cpu_set_t allowed;           /* the CPUs we were allowed at start */
+static cpu_set_t steered;           /* the CPUs the job was last given */
+static int cpu_core[CPU_SETSIZE];   /* core_id of each CPU, or -1 */
+static char banned[MAX_CORES];      /* the job is kept off this core */
+
+void steer_init(void) {
+    char path[PATH_MAX];
+    FILE* fp;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "Unable to get CPU affinity, errno %d (%s)\n",
+                errno, strerror(errno));
+        exit(-1);
+    }
+    steered = allowed;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        cpu_core[cpu] = -1;
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        snprintf(path, sizeof(path), "%s/cpu%d/topology/core_id",
+                cpu_root, cpu);
+        fp = fopen(path, "r");
+        if (fp == (FILE*)NULL)
+            continue;
+        if (fscanf(fp, "%d", &cpu_core[cpu]) != 1
+                || cpu_core[cpu] < 0 || cpu_core[cpu] >= MAX_CORES)
+            cpu_core[cpu] = -1;
+        fclose(fp);
+    }
+}
+
+static void set_task(pid_t tid, const cpu_set_t* mask) {
+    /* it may have exited since we listed it */
+    if (sched_setaffinity(tid, sizeof(*mask), mask) != 0 && errno != ESRCH)
+        fprintf(stderr, "Could not set affinity of task %ld, errno %d (%s)\n",
+                (long)tid, errno, strerror(errno));
+}
+
+static void set_task_fn(pid_t tid, void* mask) {
+    set_task(tid, (const cpu_set_t*)mask);
+}
+
+/* Give every thread of every job the new mask. Threads created later
+ * inherit it from their parent. */
+static void apply(const cpu_set_t* mask) {
+    jobs_each_task(set_task_fn, (void*)mask);
+}
+
+/* called in a new job before exec, to start it where the others are */
+void steer_enter(void) {
+    sched_setaffinity(0, sizeof(steered), &steered);
+}
+
+/* Update each core's hot/cool state from the latest readings and steer
+ * the jobs accordingly. Returns the temperature whole-job control should
+ * act on: the hottest of the cores the jobs may still use or, if they may
+ * use none of them, the hottest overall. */
+double steer_update(feature_t* features, int n, double hot, double cool) {
+    cpu_set_t mask;
+    double max_allowed = -1.0, max_all = -1.0;
+    int i, cpu, core, changed = 0;
+
+    for (i = 0; i < n; ++i) {
+        feature_t* f = &features[i];
+        core = f->core;
+        if (core < 0 || core >= MAX_CORES)
+            continue;
+        if (!banned[core] && f->value > hot) {
+            banned[core] = 1;
+            changed = 1;
+            printf("176 Core %d up to %.0f, moving %s off it\n",
+                    core, f->value, jobs_desc());
+        } else if (banned[core] && f->value < cool) {
+            banned[core] = 0;
+            changed = 1;
+            printf("177 Core %d down to %.0f, letting %s back on\n",
+                    core, f->value, jobs_desc());
+        }
+        if (f->value > max_all)
+            max_all = f->value;
+        if (!banned[core] && f->value > max_allowed)
+            max_allowed = f->value;
+    }
+
+    if (changed) {
+        CPU_ZERO(&mask);
+        for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)
+                    && (cpu_core[cpu] < 0 || !banned[cpu_core[cpu]]))
+                CPU_SET(cpu, &mask);
+        }
+        /* with nowhere cool left, leave the job where it is */
+        if (CPU_COUNT(&mask) > 0 && !CPU_EQUAL(&mask, &steered)) {
+            steered = mask;
+            apply(&steered);
+        }
+    }
+    return max_allowed >= 0.0 ? max_allowed : max_all;
+}
@@ -0,0 +1,411 @@
+/* krun-bench: measure krun's own overhead and reaction times.
+ *
+ * Sensors are mocked by a fake hwmon tree in a temporary directory, into
+ * which we play scripted temperature traces while running the real krun
+ * binary against it. Results are printed one JSON object per line:
+ *
+ *  read_ns         cost of one sample (all sensors) for each way of
+ *                  reading them: persistent fds with pread() (the hwmon
+ *                  backend), open/read/close per read as libsensors does,
+ *                  and libsensors itself on the real sensors, if any
+ *  wakeups         krun's voluntary context switches and CPU use per
+ *                  second while following a trace
+ *  stop_latency    from the temperature crossing the hot threshold to the
+ *                  child actually being stopped
+ *  exit_latency    from the child exiting to krun exiting
+ *
+ * The child for the latency runs is this program again, in probe mode.
+ */
+#include "krun.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_CORES 6
+#define READ_SAMPLES 20000
+
+const char* krun_path = "./krun";
+const char* self_path;
+char tree[] = "/tmp/krun-bench.XXXXXX";
+int trials = 5;
+
+typedef struct trace_point_s {
+    double secs;
+    double temp;
+} trace_point_t;
+
+/* rises through 80 to provoke one suspend/resume cycle, then settles */
+trace_point_t default_trace[] = {
+    { 0.0, 45.0 }, { 1.0, 70.0 }, { 1.5, 85.0 }, { 3.0, 55.0 }, { 4.0, 45.0 }
+};
+trace_point_t* trace = default_trace;
+int trace_len = sizeof(default_trace) / sizeof(default_trace[0]);
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sleep_ns(uint64_t ns) {
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+void write_file(const char* name, const char* value) {
+    char path[256];
+    FILE* fp;
+
+    snprintf(path, sizeof(path), "%s/%s", tree, name);
+    fp = fopen(path, "w");
+    if (fp == (FILE*)NULL || fputs(value, fp) < 0 || fclose(fp) != 0) {
+        fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+        exit(-1);
+    }
+}
+
+/* Set every core to temp. Written in place, without truncating, since
+ * krun keeps the files open and a truncate could let it read nothing. */
+void set_temp(double temp) {
+    char path[256], value[16];
+    int i, fd;
+
+    snprintf(value, sizeof(value), "%06ld\n", (long)(temp * 1000));
+    for (i = 0; i <= NUM_CORES; ++i) {
+        snprintf(path, sizeof(path), "%s/hwmon0/temp%d_input", tree, i + 1);
+        fd = open(path, O_WRONLY);
+        if (fd < 0 || pwrite(fd, value, strlen(value), 0) < 0) {
+            fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+            exit(-1);
+        }
+        close(fd);
+    }
+}
+
+/* a coretemp with a package sensor and NUM_CORES cores */
+void make_tree(void) {
+    char name[64], label[32];
+    int i;
+
+    if (mkdtemp(tree) == (char*)NULL) {
+        fprintf(stderr, "Unable to create %s: %s\n", tree, strerror(errno));
+        exit(-1);
+    }
+    snprintf(name, sizeof(name), "%s/hwmon0", tree);
+    mkdir(name, 0755);
+    write_file("hwmon0/name", "coretemp\n");
+    write_file("hwmon0/temp1_label", "Package id 0\n");
+    for (i = 0; i < NUM_CORES; ++i) {
+        snprintf(name, sizeof(name), "hwmon0/temp%d_label", i + 2);
+        snprintf(label, sizeof(label), "Core %d\n", i);
+        write_file(name, label);
+    }
+    for (i = 0; i <= NUM_CORES; ++i) {
+        snprintf(name, sizeof(name), "hwmon0/temp%d_input", i + 1);
+        write_file(name, "045000\n");
+    }
+}
+
+void remove_tree(void) {
+    char cmd[128];
+
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", tree);
+    if (system(cmd) != 0)
+        fprintf(stderr, "Could not remove %s\n", tree);
+}
+
+/* Time READ_SAMPLES calls of detect_temp() through the given backend; run
+ * in a child process, since sense_init() exits if there are no sensors. */
+void bench_read(const char* name, backend_t which, const char* root) {
+    uint64_t start;
+    pid_t pid;
+    int i, status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        backend = which;
+        hwmon_root = root;
+        sense_init();
+        start = now_ns();
+        for (i = 0; i < READ_SAMPLES; ++i)
+            detect_temp();
+        printf("{\"metric\":\"read_ns\",\"backend\":\"%s\",\"sensors\":%d,"
+                "\"value\":%.0f}\n", name, num_temperature_features,
+                (double)(now_ns() - start) / READ_SAMPLES);
+        exit(0);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "Skipped read_ns for %s\n", name);
+}
+
+/* the same files, opened and closed around every read */
+void bench_reopen(void) {
+    char path[256], buf[32];
+    uint64_t start;
+    int i, j, fd;
+
+    start = now_ns();
+    for (i = 0; i < READ_SAMPLES; ++i) {
+        for (j = 0; j <= NUM_CORES; ++j) {
+            snprintf(path, sizeof(path), "%s/hwmon0/temp%d_input", tree, j + 1);
+            fd = open(path, O_RDONLY);
+            if (fd < 0 || read(fd, buf, sizeof(buf)) < 0)
+                exit(-1);
+            close(fd);
+        }
+    }
+    printf("{\"metric\":\"read_ns\",\"backend\":\"reopen\",\"sensors\":%d,"
+            "\"value\":%.0f}\n", NUM_CORES + 1,
+            (double)(now_ns() - start) / READ_SAMPLES);
+}
+
+/* Start krun 80 60 on our tree, running child_argv. */
+pid_t run_krun(char** child_argv) {
+    char* argv[32];
+    int n = 0;
+    pid_t pid;
+
+    argv[n++] = (char*)krun_path;
+    argv[n++] = "-b";
+    argv[n++] = "hwmon";
+    argv[n++] = "-R";
+    argv[n++] = tree;
+    argv[n++] = "--sensor-cache=";
+    argv[n++] = "80";
+    argv[n++] = "60";
+    while (*child_argv && n < 31)
+        argv[n++] = *child_argv++;
+    argv[n] = (char*)NULL;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        /* keep krun's own status lines out of our output */
+        if (!freopen("/dev/null", "w", stdout))
+            exit(-1);
+        execv(krun_path, argv);
+        fprintf(stderr, "Unable to run %s: %s\n", krun_path, strerror(errno));
+        exit(-1);
+    }
+    return pid;
+}
+
+/* play the trace into the tree, then wait for krun */
+void bench_wakeups(void) {
+    char secs[32];
+    char* child[] = { "sleep", secs, (char*)NULL };
+    struct rusage ru;
+    uint64_t start;
+    double duration = trace[trace_len - 1].secs + 0.5;
+    int i, status;
+    pid_t pid;
+
+    set_temp(trace[0].temp);
+    snprintf(secs, sizeof(secs), "%.3f", duration);
+    start = now_ns();
+    pid = run_krun(child);
+    for (i = 1; i < trace_len; ++i) {
+        uint64_t at = start + (uint64_t)(trace[i].secs * 1e9);
+        uint64_t t = now_ns();
+        if (at > t)
+            sleep_ns(at - t);
+        set_temp(trace[i].temp);
+    }
+    wait4(pid, &status, 0, &ru);
+    duration = (now_ns() - start) / 1e9;
+    printf("{\"metric\":\"wakeups\",\"per_sec\":%.1f,\"cpu_pct\":%.3f,"
+            "\"seconds\":%.2f}\n", ru.ru_nvcsw / duration,
+            100.0 * (ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+                    + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6)
+                    / duration, duration);
+}
+
+void report(const char* metric, uint64_t* samples, int n) {
+    uint64_t sum = 0, max = 0;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        sum += samples[i];
+        if (samples[i] > max)
+            max = samples[i];
+    }
+    printf("{\"metric\":\"%s\",\"trials\":%d,\"mean_us\":%.0f,"
+            "\"max_us\":%.0f}\n", metric, n,
+            n ? sum / 1e3 / n : 0.0, max / 1e3);
+}
+
+/* Raise the temperature past the hot threshold at a random point in the
+ * sampling period, and have the probe child tell us when it was stopped. */
+void bench_stop_latency(void) {
+    char fdarg[16];
+    char* child[] = { (char*)self_path, "--probe-stop", fdarg, (char*)NULL };
+    uint64_t samples[64], crossed, stopped_at;
+    int i, n = 0, fds[2], status;
+    pid_t pid;
+
+    for (i = 0; i < trials && i < 64; ++i) {
+        if (pipe(fds) != 0)
+            exit(-1);
+        snprintf(fdarg, sizeof(fdarg), "%d", fds[1]);
+        set_temp(45.0);
+        pid = run_krun(child);
+        close(fds[1]);
+        sleep_ns(300000000ULL + (uint64_t)(rand() % 100) * 1000000ULL);
+        crossed = now_ns();
+        set_temp(90.0);
+        /* the probe can only report once it runs again */
+        sleep_ns(1500000000ULL);
+        set_temp(45.0);
+        if (read(fds[0], &stopped_at, sizeof(stopped_at))
+                == sizeof(stopped_at) && stopped_at > crossed)
+            samples[n++] = stopped_at - crossed;
+        close(fds[0]);
+        kill(pid, SIGINT);
+        waitpid(pid, &status, 0);
+    }
+    report("stop_latency", samples, n);
+}
+
+/* The probe child exits after a random delay, noting when. */
+void bench_exit_latency(void) {
+    char fdarg[16], delay[16];
+    char* child[] = {
+        (char*)self_path, "--probe-exit", fdarg, delay, (char*)NULL
+    };
+    uint64_t samples[64], exited_at, done;
+    int i, n = 0, fds[2], status;
+    pid_t pid;
+
+    set_temp(45.0);
+    for (i = 0; i < trials && i < 64; ++i) {
+        if (pipe(fds) != 0)
+            exit(-1);
+        snprintf(fdarg, sizeof(fdarg), "%d", fds[1]);
+        snprintf(delay, sizeof(delay), "%d", 200 + rand() % 100);
+        pid = run_krun(child);
+        close(fds[1]);
+        waitpid(pid, &status, 0);
+        done = now_ns();
+        if (read(fds[0], &exited_at, sizeof(exited_at)) == sizeof(exited_at))
+            samples[n++] = done - exited_at;
+        close(fds[0]);
+    }
+    report("exit_latency", samples, n);
+}
+
+/* Spin, watching the clock; the first gap of over 100ms is when we were
+ * stopped (while stopped, krun samples only once a second, so shorter
+ * gaps are just preemption). */
+int probe_stop(int fd) {
+    uint64_t last = now_ns(), t;
+
+    while (1) {
+        t = now_ns();
+        if (t - last > 100000000ULL) {
+            if (write(fd, &last, sizeof(last)) != sizeof(last))
+                return 1;
+            close(fd);
+            pause();
+        }
+        last = t;
+    }
+}
+
+int probe_exit(int fd, int delay_ms) {
+    uint64_t t;
+
+    sleep_ns(delay_ms * 1000000ULL);
+    t = now_ns();
+    return write(fd, &t, sizeof(t)) == sizeof(t) ? 0 : 1;
+}
+
+/* "secs temp" per line */
+void load_trace(const char* file) {
+    FILE* fp = fopen(file, "r");
+    double secs, temp;
+
+    if (fp == (FILE*)NULL) {
+        fprintf(stderr, "Unable to read trace '%s': %s\n",
+                file, strerror(errno));
+        exit(-1);
+    }
+    trace = (trace_point_t*)NULL;
+    trace_len = 0;
+    while (fscanf(fp, "%lf %lf", &secs, &temp) == 2) {
+        trace = realloc(trace, (trace_len + 1) * sizeof(trace_point_t));
+        trace[trace_len].secs = secs;
+        trace[trace_len++].temp = temp;
+    }
+    fclose(fp);
+    if (trace_len == 0) {
+        fprintf(stderr, "No points in trace '%s'\n", file);
+        exit(-1);
+    }
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [-k <krun>] [-n <trials>] [-t <trace>]\n"
+        "  -k  the krun binary to measure [./krun]\n"
+        "  -n  trials for each latency measurement [5]\n"
+        "  -t  temperature trace for the wakeup measurement, as lines of\n"
+        "      \"<seconds> <temperature>\" [a single suspend/resume cycle]\n",
+        prog
+    );
+    exit(-1);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+
+    self_path = argv[0];
+    if (argc == 3 && strcmp(argv[1], "--probe-stop") == 0)
+        return probe_stop(atoi(argv[2]));
+    if (argc == 4 && strcmp(argv[1], "--probe-exit") == 0)
+        return probe_exit(atoi(argv[2]), atoi(argv[3]));
+
+    while ((opt = getopt(argc, argv, "k:n:t:")) != -1) {
+        switch (opt) {
+          case 'k':
+            krun_path = optarg;
+            break;
+          case 'n':
+            trials = atoi(optarg);
+            break;
+          case 't':
+            load_trace(optarg);
+            break;
+          default:
+            usage(argv[0]);
+        }
+    }
+    srand(getpid());
+    make_tree();
+    bench_read("hwmon", BACKEND_HWMON, tree);
+    bench_reopen();
+#ifndef NO_LIBSENSORS
+    bench_read("sensors", BACKEND_SENSORS, tree);
+#endif
+    bench_wakeups();
+    bench_stop_latency();
+    bench_exit_latency();
+    remove_tree();
+    return 0;
+}
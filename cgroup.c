@@ -0,0 +1,208 @@
+/* cgroup v2 throttling.
+ *
+ * Instead of signalling the child's process group, the child is placed in
+ * a leaf cgroup of its own before exec, which catches every descendant
+ * however it rearranges sessions and process groups. We can then stop the
+ * whole job with cgroup.freeze, or limit it to a fraction of the machine's
+ * CPU time with cpu.max.
+ *
+ * The leaf is created as krun.<pid> under cgroup_parent, by default the
+ * cgroup krun itself is running in. Control files are opened with O_CREAT,
+ * as a shell redirect would, so a plain directory tree can stand in for
+ * the cgroup filesystem.
+ */
+#include "krun.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CPU_PERIOD_US 100000
+
+const char* cgroup_mount = "/sys/fs/cgroup";
+const char* cgroup_parent = (char*)NULL;
+static char leaf[PATH_MAX];
+
+static int write_control(const char* dir, const char* file,
+        const char* value) {
+    char path[PATH_MAX];
+    int fd, rc = 0;
+    size_t len = strlen(value);
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return errno;
+    if (write(fd, value, len) != (ssize_t)len)
+        rc = errno;
+    close(fd);
+    return rc;
+}
+
+/* find our own cgroup from the "0::<path>" line of /proc/self/cgroup */
+static void default_parent(char* buf, size_t len) {
+    char line[PATH_MAX];
+    FILE* fp = fopen("/proc/self/cgroup", "r");
+
+    if (fp == (FILE*)NULL) {
+        fprintf(stderr, "Unable to read /proc/self/cgroup: %s\n",
+                strerror(errno));
+        exit(-1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(buf, len, "%s%s", cgroup_mount, line + 3);
+            fclose(fp);
+            return;
+        }
+    }
+    fclose(fp);
+    fprintf(stderr, "No cgroup v2 hierarchy found in /proc/self/cgroup\n");
+    exit(-1);
+}
+
+/* Create our leaf; if want_cpu is TRUE, also make sure the cpu controller
+ * is available in it so that cpu.max can be used. */
+void cgroup_create(int want_cpu) {
+    char parent[PATH_MAX], path[PATH_MAX];
+    int fd;
+
+    if (cgroup_parent == (char*)NULL)
+        default_parent(parent, sizeof(parent));
+    else
+        snprintf(parent, sizeof(parent), "%s", cgroup_parent);
+    snprintf(leaf, sizeof(leaf), "%s/krun.%ld", parent, (long)getpid());
+    if (mkdir(leaf, 0755) != 0) {
+        fprintf(stderr, "Could not create cgroup %s, errno %d (%s)\n",
+                leaf, errno, strerror(errno));
+        exit(-1);
+    }
+    if (want_cpu) {
+        /* this fails if the parent still has processes of its own (such
+         * as krun), so it needs a delegated parent to create leaves in */
+        snprintf(path, sizeof(path), "%s/cgroup.subtree_control", parent);
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (write(fd, "+cpu", 4) != 4)
+                fprintf(stderr, "Warning: could not enable cpu controller"
+                        " in %s, errno %d (%s)\n",
+                        parent, errno, strerror(errno));
+            close(fd);
+        }
+    }
+}
+
+/* called in the child, before exec */
+void cgroup_enter(void) {
+    char pid[32];
+    int rc;
+
+    snprintf(pid, sizeof(pid), "%ld\n", (long)getpid());
+    rc = write_control(leaf, "cgroup.procs", pid);
+    if (rc != 0) {
+        fprintf(stderr, "Could not join cgroup %s, errno %d (%s)\n",
+                leaf, rc, strerror(rc));
+        exit(-1);
+    }
+}
+
+void cgroup_freeze(int frozen) {
+    int rc = write_control(leaf, "cgroup.freeze", frozen ? "1\n" : "0\n");
+    if (rc != 0) {
+        fprintf(stderr, "Tried to %s cgroup %s, errno %d (%s)\n",
+                frozen ? "freeze" : "thaw", leaf, rc, strerror(rc));
+    }
+}
+
+/* Limit the job to the given fraction of all online CPUs; 1.0 or more
+ * removes the limit. */
+void cgroup_set_quota(double fraction) {
+    char value[64];
+    long quota;
+    int rc;
+
+    if (fraction >= 1.0) {
+        snprintf(value, sizeof(value), "max %d\n", CPU_PERIOD_US);
+    } else {
+        quota = (long)(fraction * CPU_PERIOD_US * sysconf(_SC_NPROCESSORS_ONLN));
+        if (quota < 1000)
+            quota = 1000;   /* kernel minimum */
+        snprintf(value, sizeof(value), "%ld %d\n", quota, CPU_PERIOD_US);
+    }
+    rc = write_control(leaf, "cpu.max", value);
+    if (rc != 0) {
+        fprintf(stderr, "Tried to set cpu.max for cgroup %s, errno %d (%s)\n",
+                leaf, rc, strerror(rc));
+    }
+}
+
+/* freeze or thaw some other cgroup, such as a krund client's leaf;
+ * returns 0 on success, else an errno */
+int cgroup_freeze_at(const char* dir, int frozen) {
+    return write_control(dir, "cgroup.freeze", frozen ? "1\n" : "0\n");
+}
+
+/* the path of our leaf, or "" before cgroup_create() */
+const char* cgroup_leaf(void) {
+    return leaf;
+}
+
+/* the threads in our leaf, or NULL if there is none */
+FILE* cgroup_open_threads(void) {
+    char path[PATH_MAX];
+
+    if (leaf[0] == '\0')
+        return (FILE*)NULL;
+    snprintf(path, sizeof(path), "%s/cgroup.threads", leaf);
+    return fopen(path, "r");
+}
+
+/* CPU time used in our leaf so far in microseconds, from cpu.stat, or -1
+ * if there is no leaf or it has no such accounting */
+double cgroup_cpu_usage(void) {
+    char path[PATH_MAX], line[128];
+    double usec = -1.0;
+    FILE* fp;
+
+    if (leaf[0] == '\0')
+        return -1.0;
+    snprintf(path, sizeof(path), "%s/cpu.stat", leaf);
+    fp = fopen(path, "r");
+    if (fp == (FILE*)NULL)
+        return -1.0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "usage_usec %lf", &usec) == 1)
+            break;
+    }
+    fclose(fp);
+    return usec;
+}
+
+void cgroup_destroy(void) {
+    static const char* const files[] = {
+        "cgroup.procs", "cgroup.freeze", "cpu.max", (char*)NULL
+    };
+    char path[PATH_MAX];
+    int i, rc;
+
+    if (leaf[0] == '\0')
+        return;
+    rc = rmdir(leaf);
+    if (rc != 0 && errno == ENOTEMPTY) {
+        /* a stand-in tree: remove the control files we created */
+        for (i = 0; files[i]; ++i) {
+            snprintf(path, sizeof(path), "%s/%s", leaf, files[i]);
+            unlink(path);
+        }
+        rc = rmdir(leaf);
+    }
+    if (rc != 0)
+        fprintf(stderr, "Could not remove cgroup %s, errno %d (%s)\n",
+                leaf, errno, strerror(errno));
+    leaf[0] = '\0';
+}
@@ -0,0 +1,236 @@
+/* Throttle decisions.
+ *
+ * control_update() turns each temperature sample into a share: the
+ * fraction of time (or, with cpu.max, of CPU) the job is allowed, from
+ * 0 (suspended) to 1 (running freely). It has no side effects, so the
+ * same code drives both the real loop and the simulated plant below.
+ *
+ * In every mode the job is suspended outright above the hot threshold
+ * until it falls below the cool one. Short of that:
+ *  - CONTROL_HYSTERESIS runs it freely;
+ *  - CONTROL_LINEAR cuts its share as the temperature rises from cool
+ *    to hot, in 5% steps;
+ *  - CONTROL_PID holds the temperature at a setpoint, adjusting the
+ *    share continuously;
+ *  - CONTROL_FIXED gives it a fixed share;
+ *  - CONTROL_TIERS climbs a ladder of tiers by temperature, each with its
+ *    own hysteresis, applying each tier's share. A tier may also demote
+ *    the job's scheduling (see sched.c), which is left to the caller.
+ *
+ * With a prediction horizon, the thresholds are applied to where the
+ * temperature is heading as well as where it is: the job is suspended as
+ * soon as the current slope would carry it over the hot threshold within
+ * the horizon, and resumed as soon as it would bring it below the cool
+ * one. Packages keep heating for seconds after the load stops, so this
+ * lets the hot threshold sit much closer to the real limit.
+ */
+#include "krun.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* The PID output is the share itself. The integral term carries the
+ * steady-state share, so it starts at 1 (unthrottled) and is only
+ * allowed to accumulate while the output is not saturated; the
+ * derivative is taken on the measurement to avoid kicks when the
+ * setpoint changes. */
+static double pid_update(pid_ctl_t* pid, double t, double dt) {
+    double error = pid->setpoint - t;
+    double deriv = 0.0, out;
+
+    if (pid->primed && dt > 0.0)
+        deriv = -(t - pid->last_t) / dt;
+    pid->last_t = t;
+    pid->primed = 1;
+
+    out = pid->integral + pid->kp * error + pid->kd * deriv;
+    if ((out < 1.0 || error < 0.0) && (out > PID_MIN_SHARE || error > 0.0)) {
+        pid->integral += pid->ki * error * dt;
+        if (pid->integral > 1.0)
+            pid->integral = 1.0;
+        else if (pid->integral < 0.0)
+            pid->integral = 0.0;
+    }
+    if (out > 1.0)
+        out = 1.0;
+    else if (out < PID_MIN_SHARE)
+        out = PID_MIN_SHARE;
+    /* 1% resolution is plenty, and saves rewriting actuators for noise */
+    return (int)(out * 100 + 0.5) / 100.0;
+}
+
+/* Add a sample and return the least-squares slope over those in the
+ * window, in degrees per second. */
+static double predict_slope(predict_t* p, double t, double dt) {
+    double mean_x = 0.0, mean_y = 0.0, sxx = 0.0, sxy = 0.0, x;
+    int i, k;
+
+    p->clock += dt;
+    if (p->n == PREDICT_MAX) {
+        p->first = (p->first + 1) % PREDICT_MAX;
+        --p->n;
+    }
+    k = (p->first + p->n++) % PREDICT_MAX;
+    p->times[k] = p->clock;
+    p->temps[k] = t;
+    while (p->n > 2 && p->clock - p->times[p->first] > p->window) {
+        p->first = (p->first + 1) % PREDICT_MAX;
+        --p->n;
+    }
+    if (p->n < 2)
+        return 0.0;
+
+    for (i = 0; i < p->n; ++i) {
+        k = (p->first + i) % PREDICT_MAX;
+        mean_x += p->times[k];
+        mean_y += p->temps[k];
+    }
+    mean_x /= p->n;
+    mean_y /= p->n;
+    for (i = 0; i < p->n; ++i) {
+        k = (p->first + i) % PREDICT_MAX;
+        x = p->times[k] - mean_x;
+        sxx += x * x;
+        sxy += x * (p->temps[k] - mean_y);
+    }
+    return sxx > 0.0 ? sxy / sxx : 0.0;
+}
+
+/* Parse a tier, "TEMP[/EXIT]:ACTION[,ACTION...]" with actions "nice=N",
+ * "idle", "duty=PERCENT" or "stop", and add it; returns 0, or -1 if it
+ * is malformed or there are too many. */
+int control_add_tier(control_t* c, const char* spec) {
+    tier_t* t = &c->tiers[c->num_tiers];
+    char* end;
+    const char* p;
+    double duty;
+    int n;
+
+    if (c->num_tiers == MAX_TIERS)
+        return -1;
+    memset(t, 0, sizeof(*t));
+    t->share = 1.0;
+    t->enter = strtod(spec, &end);
+    t->exit = t->enter - DEFAULT_TIER_HYSTERESIS;
+    if (*end == '/')
+        t->exit = strtod(end + 1, &end);
+    if (end == spec || *end != ':' || t->exit >= t->enter)
+        return -1;
+    for (p = end + 1; *p; p += *p == ',') {
+        n = 0;
+        if (sscanf(p, "nice=%d%n", &t->nice, &n) == 1 && n > 0
+                && t->nice > 0 && t->nice < 20) {
+        } else if (sscanf(p, "duty=%lf%n", &duty, &n) == 1 && n > 0
+                && duty > 0.0 && duty <= 100.0) {
+            t->share = duty / 100.0;
+        } else if (strncmp(p, "idle", 4) == 0) {
+            t->idle = 1;
+            n = 4;
+        } else if (strncmp(p, "stop", 4) == 0) {
+            t->share = 0.0;
+            n = 4;
+        } else {
+            return -1;
+        }
+        p += n;
+        if (*p != ',' && *p != '\0')
+            return -1;
+    }
+    ++c->num_tiers;
+    return 0;
+}
+
+static int tier_cmp(const void* a, const void* b) {
+    double d = ((const tier_t*)a)->enter - ((const tier_t*)b)->enter;
+    return d < 0 ? -1 : d > 0;
+}
+
+void control_init(control_t* c, control_mode_t mode,
+        double hot, double cool) {
+    int i;
+
+    c->mode = mode;
+    c->hot = hot;
+    c->cool = cool;
+    c->hot_state = 0;
+    c->pid.primed = 0;
+    c->pid.integral = 1.0;
+    c->predict.clock = 0.0;
+    c->predict.first = 0;
+    c->predict.n = 0;
+    c->predict.slope = 0.0;
+    if (c->predict.window <= 0.0)
+        c->predict.window = DEFAULT_PREDICT_WINDOW;
+
+    /* each tier keeps the measures of those below it */
+    qsort(c->tiers, c->num_tiers, sizeof(tier_t), tier_cmp);
+    for (i = 1; i < c->num_tiers; ++i) {
+        tier_t* t = &c->tiers[i];
+        if (t->nice < t[-1].nice)
+            t->nice = t[-1].nice;
+        t->idle |= t[-1].idle;
+        if (t->share > t[-1].share)
+            t->share = t[-1].share;
+    }
+    c->tier = -1;
+}
+
+double control_update(control_t* c, double t, double dt) {
+    double share, ahead = t;
+
+    c->predict.slope = predict_slope(&c->predict, t, dt);
+    if (c->predict.horizon > 0.0)
+        ahead = t + c->predict.slope * c->predict.horizon;
+    if (c->hot_state) {
+        /* never resume while still over the limit, whatever the trend */
+        if (t >= c->cool && (ahead >= c->cool || t > c->hot))
+            return 0.0;
+        c->hot_state = 0;
+        /* restart from full output, as after a cold start */
+        c->pid.integral = 1.0;
+        c->pid.primed = 0;
+    } else if (t > c->hot || ahead > c->hot) {
+        c->hot_state = 1;
+        return 0.0;
+    }
+
+    switch (c->mode) {
+      case CONTROL_LINEAR:
+        if (c->hot <= c->cool)
+            return 1.0;
+        share = (c->hot - t) / (c->hot - c->cool);
+        if (share >= 1.0)
+            return 1.0;
+        if (share < 0.05)
+            return 0.05;
+        return (int)(share * 20) / 20.0;
+      case CONTROL_PID:
+        return pid_update(&c->pid, t, dt);
+      case CONTROL_FIXED:
+        return c->duty;
+      case CONTROL_TIERS:
+        while (c->tier + 1 < c->num_tiers && t >= c->tiers[c->tier + 1].enter)
+            ++c->tier;
+        while (c->tier >= 0 && t < c->tiers[c->tier].exit)
+            --c->tier;
+        return c->tier >= 0 ? c->tiers[c->tier].share : 1.0;
+      default:
+        return 1.0;
+    }
+}
+
+/* A two-node thermal model: the heatsink settles towards ambient plus
+ * share * sink_rise with time constant sink_tau, and the die towards the
+ * heatsink plus share * die_rise with the much shorter die_tau. That
+ * gives the fast initial rise and slow tail that make real packages
+ * overshoot. */
+void plant_init(plant_t* p) {
+    p->sink = p->ambient;
+    p->die = p->ambient;
+}
+
+double plant_step(plant_t* p, double share, double dt) {
+    p->sink += (p->ambient + share * p->sink_rise - p->sink)
+            * dt / p->sink_tau;
+    p->die += (p->sink + share * p->die_rise - p->die) * dt / p->die_tau;
+    return p->die;
+}
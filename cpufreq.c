@@ -0,0 +1,121 @@
+/* Frequency throttling.
+ *
+ * Instead of stopping the job for part of the time, slow the whole
+ * machine down: power falls faster than clock speed, so most of the work
+ * keeps going for much less heat. Below a share of 1 the first step is to
+ * turn off turbo/boost; below CPUFREQ_BOOST_SHARE each cpufreq policy's
+ * scaling_max_freq is brought down in proportion, towards cpuinfo_min_freq.
+ *
+ * The original settings are saved with sysfs_save(), so they are put back
+ * however we exit. Files are found under cpu_root, so a fake tree can
+ * stand in for /sys/devices/system/cpu.
+ */
+#include "krun.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CPUFREQ_BOOST_SHARE 0.95
+#define MAX_POLICIES 256
+
+typedef struct policy_s {
+    char path[PATH_MAX];    /* scaling_max_freq */
+    char orig[32];          /* its original contents */
+    long min, max;          /* cpuinfo_min_freq, original scaling_max_freq */
+} policy_t;
+
+static policy_t policies[MAX_POLICIES];
+static int num_policies = 0;
+static char boost_path[PATH_MAX];   /* boost or no_turbo, or empty */
+static char boost_orig[32];
+static char boost_off[4];           /* what turns it off */
+static double current = 1.0;        /* share last put into effect */
+
+static void add_policy(const char* dir) {
+    char path[PATH_MAX], buf[32];
+    policy_t* p;
+
+    if (num_policies == MAX_POLICIES)
+        return;
+    p = &policies[num_policies];
+    snprintf(p->path, sizeof(p->path), "%s/scaling_max_freq", dir);
+    snprintf(path, sizeof(path), "%s/cpuinfo_min_freq", dir);
+    p->min = sysfs_read(path, buf, sizeof(buf)) == 0 ? atol(buf) : 0;
+    if (sysfs_save(p->path, p->orig, sizeof(p->orig)) != 0)
+        return;
+    p->max = atol(p->orig);
+    if (p->max <= 0 || p->min > p->max)
+        return;
+    ++num_policies;
+}
+
+/* Find the cpufreq policies and the boost control, and remember their
+ * settings. */
+void cpufreq_init(void) {
+    char dir[PATH_MAX], path[PATH_MAX];
+    struct dirent* de;
+    DIR* d;
+
+    snprintf(dir, sizeof(dir), "%s/cpufreq", cpu_root);
+    d = opendir(dir);
+    if (d == (DIR*)NULL) {
+        fprintf(stderr, "Unable to read %s: %s\n", dir, strerror(errno));
+        exit(-1);
+    }
+    while ((de = readdir(d)) != (struct dirent*)NULL) {
+        if (strncmp(de->d_name, "policy", 6) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        add_policy(path);
+    }
+    closedir(d);
+    if (num_policies == 0) {
+        fprintf(stderr, "No cpufreq policies found in %s\n", dir);
+        exit(-1);
+    }
+
+    /* acpi-cpufreq and amd-pstate have a global boost switch, intel_pstate
+     * the inverse */
+    snprintf(boost_path, sizeof(boost_path), "%s/cpufreq/boost", cpu_root);
+    strcpy(boost_off, "0\n");
+    if (sysfs_save(boost_path, boost_orig, sizeof(boost_orig)) != 0) {
+        snprintf(boost_path, sizeof(boost_path),
+                "%s/intel_pstate/no_turbo", cpu_root);
+        strcpy(boost_off, "1\n");
+        if (sysfs_save(boost_path, boost_orig, sizeof(boost_orig)) != 0)
+            boost_path[0] = '\0';
+    }
+}
+
+/* Run at the given share of full speed: boost off below 1, and the
+ * maximum frequency cut in proportion below CPUFREQ_BOOST_SHARE. */
+void cpufreq_set_share(double share) {
+    char value[32];
+    double prev = current;
+    long freq;
+    int i;
+
+    if (share == current)
+        return;
+    current = share;
+    if (share >= 1.0) {
+        for (i = 0; i < num_policies; ++i)
+            sysfs_set(policies[i].path, policies[i].orig);
+        if (boost_path[0])
+            sysfs_set(boost_path, boost_orig);
+        return;
+    }
+    if (prev >= 1.0 && boost_path[0])
+        sysfs_set(boost_path, boost_off);
+    if (share > CPUFREQ_BOOST_SHARE)
+        share = CPUFREQ_BOOST_SHARE;
+    for (i = 0; i < num_policies; ++i) {
+        policy_t* p = &policies[i];
+        freq = p->min + (long)((p->max - p->min) * share / CPUFREQ_BOOST_SHARE);
+        snprintf(value, sizeof(value), "%ld\n", freq);
+        sysfs_set(p->path, value);
+    }
+}
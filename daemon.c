@@ -0,0 +1,288 @@
+/* krund: one governor for every krun on the machine.
+ *
+ * Rather than each krun reading the sensors and throttling its own child,
+ * a single daemon (krun --daemon, or run as krund) samples and controls,
+ * and krun --connect just starts its command and registers it over a
+ * Unix socket, with no sensor setup at all. The daemon throttles all the
+ * registered jobs together, from the one stream of samples.
+ *
+ * The protocol is a line each way. The client sends
+ *   pgrp <pid>             the process group led by pid, or
+ *   cgroup <pid> <dir>     the cgroup v2 leaf dir, which pid has joined
+ * and the daemon answers "ok <id>" or "error <reason>". The job is
+ * governed until the client closes the connection, and is resumed then
+ * if it was suspended; so a client that dies never leaves its job
+ * stopped, and a daemon that dies lets its clients resume theirs.
+ *
+ * Registrations are checked against the client's credentials: only root
+ * may register processes or cgroups it does not own.
+ */
+#define _GNU_SOURCE
+#include "krun.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_REQUEST 4200
+
+static char listen_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+/* /run/krund.sock for root, else in $XDG_RUNTIME_DIR; a client falls
+ * back to /run/krund.sock if there is no daemon of its own user's */
+const char* daemon_default_socket(int server) {
+    static char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+
+    if (getuid() == 0 || dir == (char*)NULL || dir[0] == '\0')
+        return "/run/krund.sock";
+    snprintf(path, sizeof(path), "%s/krund.sock", dir);
+    if (!server && access(path, F_OK) != 0)
+        return "/run/krund.sock";
+    return path;
+}
+
+static int make_addr(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        exit(-1);
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Returns the listening socket. Anyone may connect; what they may
+ * register is checked per request. */
+int daemon_listen(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    make_addr(path, &addr);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create socket, errno %d (%s)\n",
+                errno, strerror(errno));
+        exit(-1);
+    }
+    /* a stale socket from a daemon that died; a live one would make
+     * connect() succeed */
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "krund is already running on %s\n", path);
+        exit(-1);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+            || chmod(path, 0666) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "Could not listen on %s, errno %d (%s)\n",
+                path, errno, strerror(errno));
+        exit(-1);
+    }
+    strcpy(listen_path, addr.sun_path);
+    return fd;
+}
+
+void daemon_cleanup(int fd) {
+    close(fd);
+    if (listen_path[0])
+        unlink(listen_path);
+    listen_path[0] = '\0';
+}
+
+static void reply(int fd, const char* msg) {
+    size_t len = strlen(msg);
+    if (write(fd, msg, len) != (ssize_t)len)
+        return;     /* they will find out when they read */
+}
+
+/* may the peer on fd register something owned by owner? */
+static int allowed(int fd, uid_t owner) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return 0;
+    return cred.uid == 0 || cred.uid == owner;
+}
+
+static const char* do_register(int fd, char* line, int suspended) {
+    static char buf[64];
+    char path[PATH_MAX], dir[PATH_MAX];
+    struct stat st;
+    long pid;
+    job_t* j;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    dir[0] = '\0';
+    if (sscanf(line, "pgrp %ld", &pid) != 1
+            && sscanf(line, "cgroup %ld %4095[^\n]", &pid, dir) != 2)
+        return "error bad request\n";
+    if (dir[0] == '\0') {
+        snprintf(path, sizeof(path), "/proc/%ld", pid);
+        if (pid <= 0 || stat(path, &st) != 0)
+            return "error no such process\n";
+        if (!allowed(fd, st.st_uid))
+            return "error permission denied\n";
+        if (kill(-(pid_t)pid, 0) != 0)
+            return errno == ESRCH ? "error not a process group leader\n"
+                    : "error cannot signal process group\n";
+    } else {
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+            return "error no such cgroup\n";
+        if (!allowed(fd, st.st_uid))
+            return "error permission denied\n";
+    }
+    if (job_find((pid_t)pid))
+        return "error already registered\n";
+
+    j = job_add((pid_t)pid, fd);
+    if (dir[0])
+        j->cgroup = strdup(dir);
+    if (track_active()) {
+        track_add(j->pid);
+        track_rescan();     /* it may have forked already */
+    }
+    if (suspended) {
+        job_suspend(j, 1);
+        track_signal(SIGSTOP);
+    }
+    printf("181 Registered job %d (%s %ld%s%s)\n", j->id,
+            j->cgroup ? "pid" : "pgrp", pid,
+            j->cgroup ? " in " : "", j->cgroup ? j->cgroup : "");
+    snprintf(buf, sizeof(buf), "ok %d\n", j->id);
+    return buf;
+}
+
+/* Handle input on a client's connection: a registration, or the client
+ * going away. If suspended is TRUE the jobs are currently suspended, so
+ * a new job joins them and a departing one is resumed. */
+void daemon_read(int fd, int suspended) {
+    char line[MAX_REQUEST];
+    ssize_t n;
+    int i;
+
+    n = read(fd, line, sizeof(line) - 1);
+    if (n > 0) {
+        line[n] = '\0';
+        reply(fd, do_register(fd, line, suspended));
+        return;
+    }
+    for (i = 0; i < num_jobs; ++i) {
+        if (jobs[i].fd == fd) {
+            printf("182 Job %d (pid %ld) done\n",
+                    jobs[i].id, (long)jobs[i].pid);
+            if (suspended)
+                job_suspend(&jobs[i], 0);
+            track_remove(jobs[i].pid, suspended ? SIGCONT : 0);
+            job_remove(&jobs[i]);   /* closes fd */
+            return;
+        }
+    }
+    close(fd);
+}
+
+/* Run argv under the daemon on path, in a cgroup leaf of its own if
+ * use_cgroup is TRUE, and return its exit status. */
+int client_run(const char* path, char** argv, int use_cgroup) {
+    struct sockaddr_un addr;
+    struct signalfd_siginfo ssi;
+    struct pollfd fds[2];
+    sigset_t mask, orig_mask;
+    char buf[256];
+    int sock, sfd, status = 0, done = 0;
+    ssize_t n;
+    pid_t child;
+
+    make_addr(path, &addr);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Unable to connect to krund at %s: %s\n",
+                path, strerror(errno));
+        exit(-1);
+    }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &orig_mask);
+    sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (use_cgroup)
+        cgroup_create(0);
+
+    child = fork();
+    if (child == 0) {
+        setpgid(0, 0);
+        if (use_cgroup)
+            cgroup_enter();
+        sigprocmask(SIG_SETMASK, &orig_mask, (sigset_t*)NULL);
+        execvp(argv[0], argv);
+        fprintf(stderr, "Error running subprocess, errno %d (%s)\n",
+                errno, strerror(errno));
+        exit(-1);
+    }
+    setpgid(child, 0);
+    if (use_cgroup)
+        snprintf(buf, sizeof(buf), "cgroup %ld %s\n", (long)child,
+                cgroup_leaf());
+    else
+        snprintf(buf, sizeof(buf), "pgrp %ld\n", (long)child);
+    reply(sock, buf);
+    n = read(sock, buf, sizeof(buf) - 1);
+    buf[n > 0 ? n : 0] = '\0';
+    if (strncmp(buf, "ok ", 3) != 0) {
+        buf[strcspn(buf, "\n")] = '\0';
+        fprintf(stderr, "krund refused the job: %s\n",
+                buf[0] ? buf : "connection closed");
+        kill(-child, SIGKILL);
+    }
+
+    fds[0].fd = sfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sock;
+    fds[1].events = POLLIN;
+    while (!done) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents) {
+            /* the daemon has gone: make sure we are not left stopped */
+            fprintf(stderr, "Lost connection to krund, resuming pid %ld\n",
+                    (long)child);
+            if (use_cgroup)
+                cgroup_freeze(0);
+            else
+                kill(-child, SIGCONT);
+            fds[1].fd = -1;
+        }
+        if (!(fds[0].revents & POLLIN)
+                || read(sfd, &ssi, sizeof(ssi)) != sizeof(ssi))
+            continue;
+        if (ssi.ssi_signo != SIGCHLD) {
+            printf("174 Ctrl-C detected, killing pid %ld\n", (long)child);
+            kill(-child, SIGKILL);
+            if (use_cgroup)
+                cgroup_freeze(0);
+            continue;
+        }
+        if (waitpid(child, &status, WNOHANG) == child)
+            done = 1;
+    }
+    close(sock);
+    close(sfd);
+    if (use_cgroup)
+        cgroup_destroy();
+    /* as krun reports it: the exit status, or the signal that killed it */
+    return WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status);
+}
@@ -0,0 +1,214 @@
+/* Direct hwmon sysfs backend.
+ *
+ * libsensors opens, reads and closes the sysfs file on every call to
+ * sensors_get_value(). Here we resolve each feature to its <feature>_input
+ * file once at startup, keep it open, and re-read it with pread() at
+ * offset 0 - sysfs regenerates the contents on each read from the start.
+ *
+ * Chips are named as libsensors would name them, "prefix-bus-addr": the
+ * prefix is hwmonN/name, and the bus and address are derived from the
+ * device hwmonN/device points at, if there is one. Setting hwmon_root to
+ * a directory of fake hwmonN entries lets this run without any real
+ * sensors.
+ */
+#define _GNU_SOURCE
+#include "krun.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+const char* hwmon_root = "/sys/class/hwmon";
+
+/* read a small sysfs attribute into buf, stripping the trailing newline */
+static int read_attr(const char* path, char* buf, size_t len) {
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    n = read(fd, buf, len - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+        --n;
+    buf[n] = '\0';
+    return 0;
+}
+
+/* The bus and address of the device behind an hwmon entry, as libsensors
+ * reports them: platform "nct6775.656" is isa 0x290, i2c "0-002d" is
+ * i2c-0 0x2d, pci "0000:00:18.3" is pci 0xc3. Returns the address, or -1
+ * (and bus "virtual") if there is no device we understand. */
+static long device_addr(const char* dir, char* bus, size_t len) {
+    char path[PATH_MAX], link[PATH_MAX];
+    const char* base;
+    unsigned int domain, pbus, slot, func;
+    int nr;
+    long addr;
+    ssize_t n;
+
+    snprintf(bus, len, "virtual");
+    snprintf(path, sizeof(path), "%s/device", dir);
+    n = readlink(path, link, sizeof(link) - 1);
+    if (n < 0)
+        return -1;
+    link[n] = '\0';
+    base = strrchr(link, '/');
+    base = base ? base + 1 : link;
+    if (sscanf(base, "%x:%x:%x.%x", &domain, &pbus, &slot, &func) == 4) {
+        snprintf(bus, len, "pci");
+        return (domain << 16) + (pbus << 8) + (slot << 3) + func;
+    }
+    if (strchr(base, ':') == (char*)NULL && strchr(base, '.')) {
+        snprintf(bus, len, "isa");
+        return strtol(strchr(base, '.') + 1, (char**)NULL, 10);
+    }
+    if (sscanf(base, "%d-%lx", &nr, &addr) == 2) {
+        snprintf(bus, len, "i2c-%d", nr);
+        return addr;
+    }
+    return -1;
+}
+
+/* Does hwmon directory dir hold chip_name? The prefix runs to the first
+ * '-' and the address follows the last; either may be "*". */
+static int chip_matches(const char* dir, const char* chip_name) {
+    char name[64], path[PATH_MAX], bus[32];
+    const char *dash, *addr;
+    long have;
+
+    snprintf(path, sizeof(path), "%s/name", dir);
+    if (read_attr(path, name, sizeof(name)) != 0)
+        return 0;
+    dash = strchr(chip_name, '-');
+    if (dash == (char*)NULL)
+        return strcmp(chip_name, "*") == 0 || strcmp(chip_name, name) == 0;
+    if (!(dash - chip_name == 1 && chip_name[0] == '*')
+            && (strncmp(chip_name, name, dash - chip_name) != 0
+                || name[dash - chip_name] != '\0'))
+        return 0;
+    addr = strrchr(chip_name, '-');
+    if (addr == dash || strcmp(addr + 1, "*") == 0)
+        return 1;
+    have = device_addr(dir, bus, sizeof(bus));
+    return have < 0 || have == strtol(addr + 1, (char**)NULL, 16);
+}
+
+static int not_dot(const struct dirent* de) {
+    return de->d_name[0] != '.';
+}
+
+/* report every temp<N>_input and fan<N>_input in dir; returns the count */
+static int scan_attrs(const char* dir, const char* chip,
+        hwmon_found_fn found) {
+    struct dirent** entries;
+    char feature[32], path[PATH_MAX], label[64], type[8];
+    int i, n, nr, end, count = 0;
+
+    n = scandir(dir, &entries, not_dot, versionsort);
+    if (n < 0)
+        return 0;
+    for (i = 0; i < n; ++i) {
+        end = 0;
+        if (sscanf(entries[i]->d_name, "%7[a-z]%d_input%n",
+                    type, &nr, &end) == 2
+                && entries[i]->d_name[end] == '\0'
+                && (strcmp(type, "temp") == 0 || strcmp(type, "fan") == 0)) {
+            snprintf(feature, sizeof(feature), "%s%d", type, nr);
+            snprintf(path, sizeof(path), "%s/%s_label", dir, feature);
+            if (read_attr(path, label, sizeof(label)) != 0)
+                label[0] = '\0';
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+            found(chip, feature, label[0] ? label : (char*)NULL, path,
+                    type[0] == 'f');
+            ++count;
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return count;
+}
+
+/* Walk hwmon_root, calling found() for every temperature and fan input. */
+void hwmon_discover(hwmon_found_fn found) {
+    struct dirent** entries;
+    char dir[PATH_MAX], path[PATH_MAX], name[64], bus[32], chip[128];
+    long addr;
+    int i, n;
+
+    n = scandir(hwmon_root, &entries, not_dot, versionsort);
+    if (n < 0) {
+        fprintf(stderr, "Unable to read hwmon directory '%s': %s\n",
+                hwmon_root, strerror(errno));
+        exit(-1);
+    }
+    for (i = 0; i < n; ++i) {
+        snprintf(dir, sizeof(dir), "%s/%s", hwmon_root, entries[i]->d_name);
+        free(entries[i]);
+        snprintf(path, sizeof(path), "%s/name", dir);
+        if (read_attr(path, name, sizeof(name)) != 0)
+            continue;
+        addr = device_addr(dir, bus, sizeof(bus));
+        if (strncmp(bus, "i2c-", 4) == 0)
+            snprintf(chip, sizeof(chip), "%s-%s-%02lx", name, bus, addr);
+        else
+            snprintf(chip, sizeof(chip), "%s-%s-%04lx", name, bus,
+                    addr < 0 ? 0 : addr);
+        /* older drivers keep the attributes under device/ */
+        if (scan_attrs(dir, chip, found) == 0) {
+            snprintf(path, sizeof(path), "%s/device", dir);
+            scan_attrs(path, chip, found);
+        }
+    }
+    free(entries);
+}
+
+/* Open f->path, first checking that it still belongs to f->chip_name: the
+ * hwmonN numbering can change between boots. Returns 0 or an errno. */
+int hwmon_open_feature(feature_t* f, double scale) {
+    char dir[PATH_MAX], *slash;
+
+    snprintf(dir, sizeof(dir), "%s", f->path);
+    slash = strrchr(dir, '/');
+    if (slash == (char*)NULL)
+        return ENOENT;
+    *slash = '\0';
+    slash = strrchr(dir, '/');
+    if (slash && strcmp(slash + 1, "device") == 0)
+        *slash = '\0';
+    if (!chip_matches(dir, f->chip_name))
+        return ENOENT;
+    f->fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (f->fd < 0)
+        return errno;
+    f->scale = scale;
+    return 0;
+}
+
+/* returns 0 on success, else an errno value */
+int hwmon_read(feature_t* f, double* value) {
+    char buf[32], *end;
+    long raw;
+    ssize_t n = pread(f->fd, buf, sizeof(buf) - 1, 0);
+
+    if (n < 0)
+        return errno;
+    buf[n] = '\0';
+    raw = strtol(buf, &end, 10);
+    if (end == buf)
+        return EINVAL;
+    *value = raw / f->scale;
+    return 0;
+}
+
+void hwmon_cleanup_feature(feature_t* f) {
+    if (f->fd >= 0) {
+        close(f->fd);
+        f->fd = -1;
+    }
+}
@@ -0,0 +1,239 @@
+/* The running jobs, and the queue of commands waiting to run.
+ *
+ * Normally there is just the one job, the command from our own arguments.
+ * In batch mode commands are read one per line from a file (or stdin),
+ * and up to max_jobs of them run at once; each job is its own process
+ * group, and all of them are throttled together. Under krund, the jobs
+ * are those registered by clients, and may be cgroups instead.
+ */
+#include "krun.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+job_t* jobs = (job_t*)NULL;
+int num_jobs = 0;
+int max_jobs = 0;       /* 0: not in batch mode */
+
+static int jobs_size = 0;
+static int jobs_started = 0;
+static char** queue = (char**)NULL;
+static int queue_len = 0, queue_pos = 0;
+
+/* Read the commands to run, skipping blank lines and # comments. */
+void queue_load(const char* file) {
+    char* line = (char*)NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE* fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+
+    if (fp == (FILE*)NULL) {
+        fprintf(stderr, "Unable to read job file '%s': %s\n",
+                file, strerror(errno));
+        exit(-1);
+    }
+    while ((len = getline(&line, &size, fp)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (line[strspn(line, " \t")] == '\0' || line[0] == '#')
+            continue;
+        queue = realloc(queue, (queue_len + 1) * sizeof(char*));
+        queue[queue_len++] = strdup(line);
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+}
+
+int queue_remaining(void) {
+    return queue_len - queue_pos;
+}
+
+/* the next command to run, or NULL if there are none left */
+const char* queue_next(void) {
+    return queue_pos < queue_len ? queue[queue_pos++] : (char*)NULL;
+}
+
+job_t* job_add(pid_t pid, int fd) {
+    job_t* j;
+
+    if (num_jobs == jobs_size) {
+        jobs_size = jobs_size ? jobs_size * 2 : 4;
+        jobs = realloc(jobs, jobs_size * sizeof(job_t));
+        if (jobs == (job_t*)NULL) {
+            fprintf(stderr, "Out of memory for job table\n");
+            exit(-1);
+        }
+    }
+    j = &jobs[num_jobs++];
+    j->pid = pid;
+    j->fd = fd;
+    j->id = ++jobs_started;
+    j->energy = 0.0;
+    j->cgroup = (char*)NULL;
+    return j;
+}
+
+job_t* job_find(pid_t pid) {
+    int i;
+
+    for (i = 0; i < num_jobs; ++i) {
+        if (jobs[i].pid == pid)
+            return &jobs[i];
+    }
+    return (job_t*)NULL;
+}
+
+void job_remove(job_t* j) {
+    if (j->fd >= 0)
+        close(j->fd);
+    free(j->cgroup);
+    *j = jobs[--num_jobs];
+}
+
+/* send sig to every job, or to each job's whole process group */
+void jobs_signal(int sig, int group) {
+    int i;
+
+    for (i = 0; i < num_jobs; ++i) {
+        pid_t target = group ? -jobs[i].pid : jobs[i].pid;
+        if (kill(target, sig) != 0 && errno != ESRCH) {
+            fprintf(stderr, "Tried to send signal %d to %s %ld, errno %d\n",
+                    sig, group ? "pgrp" : "pid", (long)jobs[i].pid, errno);
+        }
+    }
+}
+
+/* Stop or continue one job: its cgroup if it has one, else its process
+ * group. */
+void job_suspend(job_t* j, int suspended) {
+    int rc;
+
+    if (j->cgroup) {
+        rc = cgroup_freeze_at(j->cgroup, suspended);
+        if (rc != 0)
+            fprintf(stderr, "Tried to %s cgroup %s, errno %d (%s)\n",
+                    suspended ? "freeze" : "thaw", j->cgroup,
+                    rc, strerror(rc));
+        return;
+    }
+    if (kill(-j->pid, suspended ? SIGSTOP : SIGCONT) != 0 && errno != ESRCH)
+        fprintf(stderr, "Tried to send signal %d to pgrp %ld, errno %d\n",
+                suspended ? SIGSTOP : SIGCONT, (long)j->pid, errno);
+}
+
+void jobs_suspend(int suspended) {
+    int i;
+
+    for (i = 0; i < num_jobs; ++i)
+        job_suspend(&jobs[i], suspended);
+    /* and any descendants that have left the process groups */
+    track_signal(suspended ? SIGSTOP : SIGCONT);
+}
+
+static void each_thread(pid_t pid, job_task_fn fn, void* arg) {
+    char path[64];
+    struct dirent* de;
+    DIR* dir;
+
+    snprintf(path, sizeof(path), "/proc/%ld/task", (long)pid);
+    dir = opendir(path);
+    if (dir == (DIR*)NULL)
+        return;
+    while ((de = readdir(dir)) != (struct dirent*)NULL) {
+        if (de->d_name[0] != '.')
+            fn((pid_t)atol(de->d_name), arg);
+    }
+    closedir(dir);
+}
+
+static void each_listed(FILE* fp, job_task_fn fn, void* arg) {
+    long tid;
+
+    if (fp == (FILE*)NULL)
+        return;
+    while (fscanf(fp, "%ld", &tid) == 1)
+        fn((pid_t)tid, arg);
+    fclose(fp);
+}
+
+/* The process group's pgrp, from /proc/<pid>/stat: "pid (comm) S ppid pgrp",
+ * where comm may itself contain spaces and parentheses. */
+static pid_t pgrp_of(const char* pid) {
+    char path[64], buf[512], *p;
+    long ppid, pgrp;
+    FILE* fp;
+
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    fp = fopen(path, "r");
+    if (fp == (FILE*)NULL)
+        return -1;
+    p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (p == (char*)NULL || (p = strrchr(buf, ')')) == (char*)NULL)
+        return -1;
+    if (sscanf(p + 1, " %*c %ld %ld", &ppid, &pgrp) != 2)
+        return -1;
+    return (pid_t)pgrp;
+}
+
+typedef struct {
+    job_task_fn fn;
+    void* arg;
+} each_t;
+
+static void each_process(pid_t pid, void* arg) {
+    each_t* each = (each_t*)arg;
+
+    each_thread(pid, each->fn, each->arg);
+}
+
+/* Call fn on every thread of every job: everything in their process
+ * groups (or, when tracking, every tracked descendant), and everything in
+ * our cgroup leaf or a registered one. A thread may be visited twice. */
+void jobs_each_task(job_task_fn fn, void* arg) {
+    char path[PATH_MAX];
+    struct dirent* de;
+    each_t each;
+    DIR* dir;
+    int i;
+
+    if (track_active()) {
+        each.fn = fn;
+        each.arg = arg;
+        track_each(each_process, &each);
+        dir = (DIR*)NULL;
+    } else
+        dir = opendir("/proc");
+    if (dir != (DIR*)NULL) {
+        while ((de = readdir(dir)) != (struct dirent*)NULL) {
+            if (de->d_name[0] >= '0' && de->d_name[0] <= '9'
+                    && job_find(pgrp_of(de->d_name)))
+                each_thread((pid_t)atol(de->d_name), fn, arg);
+        }
+        closedir(dir);
+    }
+    each_listed(cgroup_open_threads(), fn, arg);
+    for (i = 0; i < num_jobs; ++i) {
+        if (jobs[i].cgroup == (char*)NULL)
+            continue;
+        snprintf(path, sizeof(path), "%s/cgroup.threads", jobs[i].cgroup);
+        each_listed(fopen(path, "r"), fn, arg);
+    }
+}
+
+/* "pid N" for a single job, else "N jobs", for status lines */
+const char* jobs_desc(void) {
+    static char buf[32];
+
+    if (num_jobs == 1)
+        snprintf(buf, sizeof(buf), "pid %ld", (long)jobs[0].pid);
+    else
+        snprintf(buf, sizeof(buf), "%d jobs", num_jobs);
+    return buf;
+}
@@ -1,161 +1,202 @@
-#include <sensors/sensors.h>
-#include <sensors/error.h>
+#define _GNU_SOURCE
+#include "krun.h"
+#include <getopt.h>
 #include <unistd.h>
 #include <wait.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-#define NUM_TEMPERATURE_FEATURES 6
-#define NUM_FAN_FEATURES 2
+/* sampling period while suspended and while running */
 const struct timespec hot_delay = { 1, 0 };
 const struct timespec cool_delay = { 0, 100 * 1000000 };
 
-volatile int killed = 0;     /* ctrl-C was pressed and not yet handled */
-volatile int hot_killed = 0; /* ctrl-C pressed while suspended */
-
-typedef struct feature_s {
-    const char* chip_name;
-    const char* feature_name;
-    const sensors_chip_name* chip;
-    const sensors_feature* feature;
-    int subfeature_i;
-} feature_t;
-
-feature_t temperature_features[NUM_TEMPERATURE_FEATURES] = {
-    { "coretemp-isa-0000", "temp2" }, /* Core 0 */
-    { "coretemp-isa-0000", "temp3" }, /* Core 1 */
-    { "coretemp-isa-0000", "temp4" }, /* Core 2 */
-    { "coretemp-isa-0000", "temp5" }, /* Core 3 */
-    { "coretemp-isa-0000", "temp6" }, /* Core 4 */
-    { "coretemp-isa-0000", "temp7" }  /* Core 5 */
-};
-feature_t fan_features[NUM_FAN_FEATURES] = {
-    { "nct6776-isa-0290", "fan1" },
-    { "nct6776-isa-0290", "fan2" }
+/* Adaptive sampling: the period is instead chosen at each sample to give
+ * several samples before the temperature could reach the threshold it is
+ * heading for, at its current rate or at least ADAPT_RATE, within the
+ * bounds given. Until within ADAPT_SWEEP_MARGIN of the hot threshold,
+ * only the package and die sensors are read. */
+#define ADAPT_RATE 10.0         /* degrees per second */
+#define ADAPT_SAMPLES 2         /* samples wanted before the threshold */
+#define ADAPT_SWEEP_MARGIN 10.0 /* degrees */
+int adaptive = 0;
+double sample_min = 0.05, sample_max = 1.0;
+
+/* The main loop sleeps in epoll_wait() on all of these, so it wakes only to
+ * take a sample or when a signal arrives or a job exits. Events carry the
+ * tag in their low 32 bits; for EV_CHILD the job's pid is in the high 32,
+ * for EV_CLIENT the connection's fd.
+ */
+enum { EV_TIMER, EV_SIGNAL, EV_CHILD, EV_PWM, EV_LISTEN, EV_CLIENT, EV_PROC };
+#define MAX_EVENTS 8
+int epoll_fd;
+int timer_fd;       /* timerfd firing at the sampling period */
+int signal_fd;      /* signalfd for SIGINT, SIGTERM and SIGCHLD */
+int pwm_fd;         /* timerfd for the duty-cycle engine's edges */
+sigset_t orig_mask; /* signal mask to restore in the child */
+int null_stdin = 0; /* give jobs /dev/null for stdin, as we're reading it */
+int interrupted = 0; /* Ctrl-C seen: start no more jobs */
+double admit_threshold = 0.0;   /* batch mode: start jobs only below this */
+int listen_fd = -1;   /* krund: the socket clients connect to */
+
+/* how the child is stopped and slowed down */
+typedef enum { THROTTLE_SIGNAL, THROTTLE_FREEZE, THROTTLE_CPUMAX } throttle_t;
+throttle_t throttle = THROTTLE_SIGNAL;
+
+control_t control = {
+    CONTROL_HYSTERESIS, 0.0, 0.0, 0, 1.0,
+    { 0.0, DEFAULT_KP, DEFAULT_KI, DEFAULT_KD },
+    { 0.0, DEFAULT_PREDICT_WINDOW }
 };
+double share = 1.0;   /* share of time the jobs currently get */
+double quota = 1.0;   /* current cpu.max limit, for THROTTLE_CPUMAX */
+double reported = 1.0; /* share last reported with a 175 line */
+int stopped = 0;      /* the jobs are currently suspended */
+int steer = 0;        /* steer the jobs away from hot cores */
+int cpufreq = 0;      /* throttle by clock frequency rather than duty */
+int powercap = 0;     /* throttle by RAPL power limit rather than duty */
+int energy = 0;       /* account package energy to the jobs */
+int track = 0;        /* follow descendants out of the process groups */
 
-void init_feature(feature_t* f, int feature_type) {
-    int rc, sci, sfi;
-    sensors_chip_name sc;
-    const sensors_subfeature* sf;
+uint64_t pwm_period_ns = 50 * 1000000ULL;
+int pwm_active = 0;   /* the duty-cycle engine is running */
+int pwm_on;           /* in the run phase of the current period */
+uint64_t pwm_base;    /* start of the current period */
 
-    rc = sensors_parse_chip_name(f->chip_name, &sc);
-    if (rc != 0) {
-        fprintf(stderr, "Unable to parse chip name '%s' (%d): %s\n",
-                f->chip_name, rc, sensors_strerror(rc));
-        exit(-1);
-    }
+/* defaults for --simulate: full load settles at 95C from 35C ambient */
+plant_t plant = { 35.0, 40.0, 40.0, 20.0, 3.0 };
 
-    sci = 0;
-    while (1) {
-        f->chip = sensors_get_detected_chips(&sc, &sci);
-        if (f->chip == (sensors_chip_name*)NULL) {
-            fprintf(stderr, "Failed to find feature '%s' on chip '%s'\n",
-                    f->feature_name, f->chip_name);
-            exit(-1);
-        }
-        sfi = 0;
-        while (1) {
-            f->feature = sensors_get_features(f->chip, &sfi);
-            if (f->feature == (sensors_feature*)NULL) {
-                break;
-            }
-            if (f->feature->name != (char*)NULL
-                    && strcmp(f->feature_name, f->feature->name) == 0) {
-                goto found_feature;
-            }
-        }
-    }
+void watch_fd(int fd, uint64_t data) {
+    struct epoll_event ev;
 
-  found_feature:
-    sf = sensors_get_subfeature(f->chip, f->feature, feature_type);
-    if (sf == (sensors_subfeature *)NULL) {
-        fprintf(stderr, "Can't find input subfeature for %s:%s\n",
-                f->chip_name, f->feature_name);
+    ev.events = EPOLLIN;
+    ev.data.u64 = data;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        fprintf(stderr, "Could not add fd %d to epoll set, errno %d (%s)\n",
+                fd, errno, strerror(errno));
         exit(-1);
     }
-    f->subfeature_i = sf->number;
-    sensors_free_chip_name(&sc);
 }
 
-void handle_INT(int signum) {
-    killed = 1;
-    hot_killed = 1;
-}
+/* (re)arm the sampling timer; if now is TRUE, the first sample is taken
+ * immediately rather than after one period */
+void set_sample_period(const struct timespec* period, int now) {
+    struct itimerspec its;
 
-void init(void) {
-    int rc, i;
-    struct sigaction action;
-
-    /* /usr/bin/sensors source passes NULL for default, I assume that's ok */
-    rc = sensors_init((FILE*)NULL);
-    if (rc != 0) {
-        fprintf(stderr, "sensors_init() error (%d): %s\n",
-                rc, sensors_strerror(rc));
+    its.it_interval = *period;
+    if (now) {
+        its.it_value.tv_sec = 0;
+        its.it_value.tv_nsec = 1;
+    } else {
+        its.it_value = *period;
+    }
+    if (timerfd_settime(timer_fd, 0, &its, (struct itimerspec*)NULL) != 0) {
+        fprintf(stderr, "Could not set sample timer, errno %d (%s)\n",
+                errno, strerror(errno));
         exit(-1);
     }
-    for (i = 0; i < NUM_TEMPERATURE_FEATURES; ++i) {
-        feature_t* f = &temperature_features[i];
-        init_feature(f, SENSORS_SUBFEATURE_TEMP_INPUT);
+}
+
+/* the period until the next sample, in seconds, at temperature t */
+double sample_period(double t) {
+    double headroom, rate, period;
+
+    if (!adaptive) {
+        return control.hot_state
+                ? hot_delay.tv_sec + hot_delay.tv_nsec / 1e9
+                : cool_delay.tv_sec + cool_delay.tv_nsec / 1e9;
     }
-    for (i = 0; i < NUM_FAN_FEATURES; ++i) {
-        feature_t* f = &fan_features[i];
-        init_feature(f, SENSORS_SUBFEATURE_FAN_INPUT);
+    if (control.hot_state) {
+        headroom = t - control.cool;
+        rate = -control.predict.slope;
+    } else {
+        headroom = control.hot - t;
+        rate = control.predict.slope;
     }
-
-    /* We must catch SIGINT so as to propagate it to the child */
-    action.sa_handler = handle_INT;
-    sigemptyset(&action.sa_mask);
-    action.sa_flags = 0;
-    sigaction(SIGINT, &action, NULL);
+    if (rate < ADAPT_RATE)
+        rate = ADAPT_RATE;
+    period = headroom / rate / ADAPT_SAMPLES;
+    if (period < sample_min)
+        period = sample_min;
+    else if (period > sample_max)
+        period = sample_max;
+    /* sampling for others, who may need it sooner */
+    if (shm_is_sampler() && period > cool_delay.tv_nsec / 1e9)
+        period = cool_delay.tv_nsec / 1e9;
+    return period;
 }
 
-void cleanup(void) {
-    sensors_cleanup();
-}
+void init(void) {
+    sigset_t mask;
 
-double detect_temp(void) {
-    int i, rc;
-    double value;
-    double max = -1.0;
-
-    for (i = 0; i < NUM_TEMPERATURE_FEATURES; ++i) {
-        feature_t* f = &temperature_features[i];
-        rc = sensors_get_value(f->chip, f->subfeature_i, &value);
-        if (rc != 0) {
-            fprintf(stderr, "Unable to read value for %s:%s (%d): %s\n",
-                    f->chip_name, f->feature_name, rc, sensors_strerror(rc));
-            exit(-1);
-        }
-        if (value > max) {
-            max = value;
-        }
+    sense_init();
+
+    /* We must catch SIGINT (and SIGTERM) so as to propagate it to the
+     * child, and SIGCHLD tells us when it exits. Block them all and take
+     * them from a signalfd instead of in a handler; the block is inherited
+     * over fork(), so nothing is lost before we first look. */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &orig_mask);
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    pwm_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || timer_fd < 0 || pwm_fd < 0 || epoll_fd < 0) {
+        fprintf(stderr, "Could not set up event fds, errno %d (%s)\n",
+                errno, strerror(errno));
+        exit(-1);
     }
-    return max;
+    watch_fd(timer_fd, EV_TIMER);
+    watch_fd(signal_fd, EV_SIGNAL);
+    watch_fd(pwm_fd, EV_PWM);
 }
 
-void detect_fan(void) {
-    int i, rc;
-    double value;
+/* Watch for a job's exit via a pidfd; on kernels without pidfd_open()
+ * (before 5.3) we still hear about it through SIGCHLD. */
+int watch_child(pid_t child) {
+    int fd = syscall(SYS_pidfd_open, child, 0);
+    if (fd >= 0)
+        watch_fd(fd, ((uint64_t)child << 32) | EV_CHILD);
+    return fd;
+}
 
-    for (i = 0; i < NUM_FAN_FEATURES; ++i) {
-        feature_t* f = &fan_features[i];
-        rc = sensors_get_value(f->chip, f->subfeature_i, &value);
-        if (rc != 0) {
-            fprintf(stderr, "Unable to read value for %s:%s (%d): %s\n",
-                    f->chip_name, f->feature_name, rc, sensors_strerror(rc));
-            exit(-1);
-        }
-        printf("Got %s:%s = %.3f\n", f->chip_name, f->feature_name, value); 
+void cleanup(void) {
+    if (throttle != THROTTLE_SIGNAL)
+        cgroup_destroy();
+    close(timer_fd);
+    close(pwm_fd);
+    close(signal_fd);
+    close(epoll_fd);
+
+    if (listen_fd >= 0)
+        daemon_cleanup(listen_fd);
+    if (track) {
+        /* don't leave escaped descendants stopped behind us */
+        if (stopped)
+            track_signal(SIGCONT);
+        track_cleanup();
     }
+    if (energy)
+        powercap_cleanup();
+    telemetry_close();
+    shm_cleanup();
+    sense_cleanup();
 }
 
-pid_t start_child(int argc, char** argv) {
+pid_t start_child(char** argv) {
     pid_t p = fork();
     /* set the child to its own process group in both branches: we want to
      * be sure that it is set before further action in either child or parent
@@ -172,57 +213,666 @@ pid_t start_child(int argc, char** argv) {
                 exit(-1);
             }
         }
+        job_add(p, watch_child(p));
         return p;
     }
     /* I'm the child */
     setpgid(0, 0);
+    if (throttle != THROTTLE_SIGNAL)
+        cgroup_enter();
+    if (steer)
+        steer_enter();
+    sched_enter();
+    if (null_stdin && !freopen("/dev/null", "r", stdin)) {
+        fprintf(stderr, "Could not reopen stdin, errno %d (%s)\n",
+                errno, strerror(errno));
+        exit(-1);
+    }
+    sigprocmask(SIG_SETMASK, &orig_mask, (sigset_t*)NULL);
     execvp(argv[0], argv);
     fprintf(stderr, "Error running subprocess, errno %d (%s)\n",
             errno, strerror(errno));
     exit(-1);
 }
 
-void resume(pid_t child) {
-    int rc = kill(-child, SIGCONT);
-    if (rc != 0) {
-        fprintf(stderr, "Tried to CONT pgrp %ld, errno %d\n", (long)child, rc);
+/* run the next command from the queue */
+void start_queued(void) {
+    char* argv[4];
+    job_t* j;
+
+    argv[0] = "/bin/sh";
+    argv[1] = "-c";
+    argv[2] = (char*)queue_next();
+    argv[3] = (char*)NULL;
+    start_child(argv);
+    j = &jobs[num_jobs - 1];
+    printf("178 Starting job %d as pid %ld: %s\n",
+            j->id, (long)j->pid, argv[2]);
+}
+
+void resume(void) {
+    if (throttle != THROTTLE_SIGNAL) {
+        cgroup_freeze(0);
+        return;
     }
+    jobs_suspend(0);
 }
 
-void suspend(pid_t child) {
-    int rc = kill(-child, SIGSTOP);
-    if (rc != 0) {
-        fprintf(stderr, "Tried to STOP pgrp %ld, errno %d\n", (long)child, rc);
+void suspend(void) {
+    if (throttle != THROTTLE_SIGNAL) {
+        cgroup_freeze(1);
+        return;
     }
+    jobs_suspend(1);
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Duty-cycle engine: while the share is strictly between 0 and 1, each
+ * pwm_period is split into a run phase of share * pwm_period followed by
+ * a stop phase. Edges are set as absolute times from the start of the
+ * current period, so timer latency never accumulates into drift; a new
+ * share takes effect from the next period. */
+void pwm_arm(uint64_t edge) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = edge / 1000000000ULL;
+    its.it_value.tv_nsec = edge % 1000000000ULL;
+    timerfd_settime(pwm_fd, TFD_TIMER_ABSTIME, &its, (struct itimerspec*)NULL);
 }
 
-/* try to kill the child, return TRUE if it has exited */
-void kill_child(pid_t child) {
-    int rc = kill(child, SIGKILL);
-    if (rc != 0) {
-        fprintf(stderr, "Tried to INT pid %ld, errno %d\n", (long)child, rc);
+void pwm_start(void) {
+    pwm_active = 1;
+    pwm_on = 1;
+    pwm_base = monotonic_ns();
+    if (stopped)
+        resume();
+    stopped = 0;
+    pwm_arm(pwm_base + (uint64_t)(share * pwm_period_ns));
+}
+
+void pwm_stop(void) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(pwm_fd, 0, &its, (struct itimerspec*)NULL);
+    pwm_active = 0;
+}
+
+/* the pwm timer fired: flip to the other phase */
+void pwm_edge(void) {
+    uint64_t now;
+
+    if (!pwm_active)
+        return;
+    if (pwm_on) {
+        suspend();
+        stopped = 1;
+        pwm_on = 0;
+        pwm_arm(pwm_base + pwm_period_ns);
+        return;
     }
+    pwm_base += pwm_period_ns;
+    now = monotonic_ns();
+    if (now > pwm_base + pwm_period_ns)
+        pwm_base = now;     /* we fell a whole period behind, start afresh */
+    resume();
+    stopped = 0;
+    pwm_on = 1;
+    pwm_arm(pwm_base + (uint64_t)(share * pwm_period_ns));
+}
+
+/* Put a new share into effect: cpu.max, cpufreq and powercap can take it
+ * directly, otherwise shares between 0 and 1 are handed to the duty-cycle
+ * engine. */
+void apply_share(double new_share) {
+    share = new_share;
+    if (new_share > 0.0 && new_share < 1.0 && throttle != THROTTLE_CPUMAX
+            && !cpufreq && !powercap) {
+        if (!pwm_active)
+            pwm_start();
+        return;
+    }
+    if (pwm_active)
+        pwm_stop();
+    if (new_share == 0.0) {
+        if (!stopped)
+            suspend();
+        stopped = 1;
+    } else {
+        if (throttle == THROTTLE_CPUMAX && new_share != quota) {
+            quota = new_share;
+            cgroup_set_quota(quota);
+        }
+        if (cpufreq)
+            cpufreq_set_share(new_share);
+        if (powercap)
+            powercap_set_share(new_share);
+        if (stopped)
+            resume();
+        stopped = 0;
+    }
+}
+
+/* what a tier does, for status lines */
+const char* tier_desc(int tier) {
+    static char buf[64];
+    tier_t* t;
+    int n = 0;
+
+    if (tier < 0)
+        return "unthrottled";
+    t = &control.tiers[tier];
+    buf[0] = '\0';
+    if (t->nice > 0)
+        n += snprintf(buf + n, sizeof(buf) - n, ", nice %d", t->nice);
+    if (t->idle)
+        n += snprintf(buf + n, sizeof(buf) - n, ", SCHED_IDLE");
+    if (t->share == 0.0)
+        n += snprintf(buf + n, sizeof(buf) - n, ", stopped");
+    else if (t->share < 1.0)
+        n += snprintf(buf + n, sizeof(buf) - n, ", %.0f%% duty",
+                t->share * 100);
+    return n > 0 ? buf + 2 : "unthrottled";
+}
+
+/* Share out the energy used since we last looked equally among the jobs
+ * running; it is the whole packages' energy, so includes anything else
+ * running at the same time. */
+void account_energy(void) {
+    double joules;
+    int i;
+
+    if (!energy)
+        return;
+    joules = powercap_energy();
+    for (i = 0; i < num_jobs; ++i)
+        jobs[i].energy += joules / num_jobs;
+}
+
+/* Reap every job that has exited, returning the exit status to report:
+ * that of the single job, or in batch mode 0 unless some job failed. */
+int reap_jobs(int status) {
+    siginfo_t si;
+    job_t* j;
+
+    while (num_jobs > 0) {
+        si.si_pid = 0;
+        if (waitid(P_ALL, 0, &si, WEXITED | WNOHANG) != 0) {
+            if (errno == ECHILD)
+                break;
+            fprintf(stderr, "Failed to wait for jobs, errno %d (%s)\n",
+                    errno, strerror(errno));
+            exit(-1);
+        }
+        if (si.si_pid == 0)
+            break;
+        j = job_find(si.si_pid);
+        if (j == (job_t*)NULL)
+            continue;
+        account_energy();
+        if (energy)
+            printf("180 Job %d (pid %ld) used %.1f J\n",
+                    j->id, (long)j->pid, j->energy);
+        if (max_jobs > 0) {
+            printf("179 Job %d (pid %ld) %s %d\n", j->id, (long)j->pid,
+                    si.si_code == CLD_EXITED ? "exited with status"
+                            : "killed by signal",
+                    si.si_status);
+            if (si.si_status != 0)
+                status = si.si_status;
+        } else {
+            status = si.si_status;
+        }
+        job_remove(j);
+    }
+    return status;
 }
     
+void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [options] <hot_threshold> <cool_threshold> <prog> <args ...>\n"
+        "       %s [options] -j <n> -f <file> <hot_threshold> <cool_threshold>\n"
+        "       %s --daemon [options] <hot_threshold> <cool_threshold>\n"
+        "       %s --connect [--socket=PATH] [-c freeze] <prog> <args ...>\n"
+        "Options:\n"
+        "  -b, --backend=NAME     read sensors via 'sensors' (libsensors)"
+                                   " or 'hwmon' (sysfs)\n"
+        "  -R, --hwmon-root=DIR   hwmon tree for the hwmon backend"
+                                   " [/sys/class/hwmon]\n"
+        "  -i, --include=PATTERN  monitor sensors matching PATTERN, a glob on"
+                                   " chip or\n"
+        "                         chip:feature or chip:label (repeatable)"
+                                   " [CPU sensors]\n"
+        "  -x, --exclude=PATTERN  don't monitor sensors matching PATTERN"
+                                   " (repeatable)\n"
+        "  -l, --list-sensors     list the sensors that would be monitored,"
+                                   " and exit\n"
+        "      --sensor-cache=FILE  where the hwmon backend caches the"
+                                   " resolved sensors\n"
+        "                         [~/.cache/krun-sensors; empty to disable]\n"
+        "  -c, --cgroup=MODE      run the child in its own cgroup v2 leaf and"
+                                   " throttle it\n"
+        "                         with 'freeze' (cgroup.freeze) or 'cpumax'"
+                                   " (cpu.max quota)\n"
+        "  -C, --cgroup-parent=DIR  create the leaf under DIR"
+                                   " [krun's own cgroup]\n"
+        "  -t, --track            follow every descendant of the child, even"
+                                   " those that\n"
+        "                         leave its process group (proc connector)\n"
+        "  -F, --cpufreq          below the hot threshold, slow the machine"
+                                   " down instead\n"
+        "                         of stopping the child: boost off, then"
+                                   " lower\n"
+        "                         scaling_max_freq (restored at exit)\n"
+        "      --powercap         below the hot threshold, lower the RAPL"
+                                   " package power\n"
+        "                         limits instead of stopping the child"
+                                   " (restored at exit)\n"
+        "      --energy           report the package energy each job used"
+                                   " (RAPL)\n"
+        "      --powercap-root=DIR  powercap sysfs tree"
+                                   " [/sys/class/powercap]\n"
+        "      --cpu-root=DIR     CPU sysfs tree for -a and -F"
+                                   " [/sys/devices/system/cpu]\n"
+        "  -a, --affinity         keep the child off individual cores while"
+                                   " they are hot,\n"
+        "                         suspending it only when all of them are\n"
+        "  -P, --setpoint=TEMP    hold the temperature at TEMP by continuously"
+                                   " adjusting\n"
+        "                         the child's share of time (PID control)\n"
+        "      --pid=KP,KI,KD     PID gains [%g,%g,%g]\n"
+        "      --adaptive=MIN,MAX  choose each sampling period, between"
+                                   " MIN and MAX\n"
+        "                         ms, from how soon the temperature could"
+                                   " reach a\n"
+        "                         threshold\n"
+        "      --predict=SECS     also throttle when the temperature is"
+                                   " heading over\n"
+        "                         the hot threshold within SECS, and resume"
+                                   " when it\n"
+        "                         is heading below the cool one\n"
+        "      --predict-window=SECS  take the temperature slope over the"
+                                   " last SECS [%g]\n"
+        "  -T, --tier=TEMP[/EXIT]:ACTION[,ACTION]  from TEMP until below EXIT"
+                                   " [TEMP-%g],\n"
+        "                         throttle by each ACTION: nice=N, idle"
+                                   " (SCHED_IDLE),\n"
+        "                         duty=PERCENT or stop; repeat for a ladder"
+                                   " of tiers\n"
+        "  -d, --duty=PERCENT     below the hot threshold, let the child run"
+                                   " only PERCENT\n"
+        "                         of the time\n"
+        "      --pwm-period=MS    length of each run/stop cycle when the"
+                                   " share is\n"
+        "                         between 0 and 100%% [%g]\n"
+        "  -j, --jobs=N           batch mode: run the commands from --job-file,"
+                                   " up to N\n"
+        "                         at a time, throttling them together\n"
+        "  -f, --job-file=FILE    commands to run, one per line, or '-' for"
+                                   " stdin\n"
+        "      --telemetry=DEST   write a record of every sample to the file"
+                                   " DEST, or to\n"
+        "                         descriptor N for 'fd:N'\n"
+        "      --telemetry-format=FMT  'json' (one object per line) or"
+                                   " 'csv' [json]\n"
+        "      --admit=TEMP       batch mode: start another job only below"
+                                   " TEMP\n"
+        "                         [midway between the thresholds]\n"
+        "      --daemon           run as krund: govern the jobs that"
+                                   " 'krun --connect'\n"
+        "                         registers, together\n"
+        "      --connect          run <prog> under krund rather than"
+                                   " monitoring it here;\n"
+        "                         with -c, register it as a cgroup leaf\n"
+        "      --socket=PATH      krund's socket [/run/krund.sock for root,"
+                                   " else\n"
+        "                         $XDG_RUNTIME_DIR/krund.sock]\n"
+        "      --shared[=DIR]     share sensor readings with other krun"
+                                   " instances through\n"
+        "                         a page in DIR [/dev/shm]: one samples,"
+                                   " the rest read\n"
+        "  -S, --simulate=SECS    run the controller against a simulated"
+                                   " thermal plant\n"
+        "                         for SECS of virtual time, printing each"
+                                   " sample; no <prog>\n"
+        "      --plant=AMB,SR,ST,DR,DT  plant ambient, heatsink rise and"
+                                   " time constant,\n"
+        "                         die rise and time constant [%g,%g,%g,%g,%g]\n",
+        prog, prog, prog, prog, DEFAULT_KP, DEFAULT_KI, DEFAULT_KD,
+        DEFAULT_PREDICT_WINDOW, DEFAULT_TIER_HYSTERESIS, pwm_period_ns / 1e6,
+        plant.ambient, plant.sink_rise, plant.sink_tau,
+        plant.die_rise, plant.die_tau
+    );
+    exit(-1);
+}
+
+enum {
+    OPT_PID = 256, OPT_PLANT, OPT_PWM_PERIOD, OPT_SENSOR_CACHE, OPT_ADMIT,
+    OPT_TELEMETRY, OPT_TELEMETRY_FORMAT, OPT_PREDICT, OPT_PREDICT_WINDOW,
+    OPT_ADAPTIVE, OPT_CPU_ROOT, OPT_POWERCAP, OPT_ENERGY, OPT_POWERCAP_ROOT,
+    OPT_DAEMON, OPT_CONNECT, OPT_SOCKET, OPT_SHARED
+};
+const struct option long_options[] = {
+    { "backend", required_argument, NULL, 'b' },
+    { "hwmon-root", required_argument, NULL, 'R' },
+    { "include", required_argument, NULL, 'i' },
+    { "exclude", required_argument, NULL, 'x' },
+    { "list-sensors", no_argument, NULL, 'l' },
+    { "sensor-cache", required_argument, NULL, OPT_SENSOR_CACHE },
+    { "cgroup", required_argument, NULL, 'c' },
+    { "cgroup-parent", required_argument, NULL, 'C' },
+    { "cpufreq", no_argument, NULL, 'F' },
+    { "cpu-root", required_argument, NULL, OPT_CPU_ROOT },
+    { "powercap", no_argument, NULL, OPT_POWERCAP },
+    { "energy", no_argument, NULL, OPT_ENERGY },
+    { "powercap-root", required_argument, NULL, OPT_POWERCAP_ROOT },
+    { "track", no_argument, NULL, 't' },
+    { "affinity", no_argument, NULL, 'a' },
+    { "setpoint", required_argument, NULL, 'P' },
+    { "pid", required_argument, NULL, OPT_PID },
+    { "adaptive", required_argument, NULL, OPT_ADAPTIVE },
+    { "predict", required_argument, NULL, OPT_PREDICT },
+    { "predict-window", required_argument, NULL, OPT_PREDICT_WINDOW },
+    { "tier", required_argument, NULL, 'T' },
+    { "duty", required_argument, NULL, 'd' },
+    { "pwm-period", required_argument, NULL, OPT_PWM_PERIOD },
+    { "jobs", required_argument, NULL, 'j' },
+    { "job-file", required_argument, NULL, 'f' },
+    { "admit", required_argument, NULL, OPT_ADMIT },
+    { "telemetry", required_argument, NULL, OPT_TELEMETRY },
+    { "telemetry-format", required_argument, NULL, OPT_TELEMETRY_FORMAT },
+    { "daemon", no_argument, NULL, OPT_DAEMON },
+    { "connect", no_argument, NULL, OPT_CONNECT },
+    { "socket", required_argument, NULL, OPT_SOCKET },
+    { "shared", optional_argument, NULL, OPT_SHARED },
+    { "simulate", required_argument, NULL, 'S' },
+    { "plant", required_argument, NULL, OPT_PLANT },
+    { NULL, 0, NULL, 0 }
+};
+
+/* In batch mode, may another job start? Only while all of the current
+ * ones are running freely and the temperature is below admit_threshold. */
+int can_admit(double t) {
+    return queue_remaining() > 0 && num_jobs < max_jobs && !interrupted
+            && !control.hot_state && share >= 1.0 && t < admit_threshold;
+}
+
+/* $XDG_CACHE_HOME/krun-sensors, or ~/.cache/krun-sensors */
+const char* default_sensor_cache(void) {
+    static char path[4096];
+    const char* dir = getenv("XDG_CACHE_HOME");
+
+    if (dir && dir[0]) {
+        snprintf(path, sizeof(path), "%s/krun-sensors", dir);
+    } else {
+        dir = getenv("HOME");
+        if (dir == (char*)NULL || dir[0] == '\0')
+            return (char*)NULL;
+        snprintf(path, sizeof(path), "%s/.cache/krun-sensors", dir);
+    }
+    return path;
+}
+
+/* Run the controller against the simulated plant in virtual time, at the
+ * same sample periods as the real loop, printing time, temperature and
+ * share at each sample, and finally the fraction of time the job got. */
+void simulate(double secs) {
+    double t, dt = sample_period(plant.ambient), s = 1.0;
+    double elapsed = 0.0, run = 0.0, max = 0.0;
+    int samples = 0;
+
+    plant_init(&plant);
+    printf("# time temp share\n");
+    while (elapsed < secs) {
+        t = plant_step(&plant, s, dt);
+        run += s * dt;
+        elapsed += dt;
+        if (t > max)
+            max = t;
+        s = control_update(&control, t, dt);
+        dt = sample_period(t);
+        ++samples;
+        printf("%.1f %.2f %.2f\n", elapsed, t, s);
+    }
+    printf("# run fraction %.3f, max temperature %.1f, %.1f samples/s\n",
+            run / elapsed, max, samples / elapsed);
+}
+
 int main(int argc, char** argv) {
-    double t, cool_threshold, hot_threshold;
-    pid_t child;
-    int hot = 0, waited;
-    siginfo_t si;
+    double t = 0.0, cool_threshold, hot_threshold, new_share, dt;
+    double setpoint = 0.0, duty = 0.0, simulate_secs = 0.0;
+    control_mode_t mode = CONTROL_HYSTERESIS;
+    struct timespec now, last, period;
+    int hot = 0, killed = 0, status = 0, opt, i, n, list = 0, cache_set = 0;
+    int fd, tier = -1;
+    const char* job_file = (char*)NULL;
+    const char* telemetry = (char*)NULL;
+    const char* socket_path = (char*)NULL;
+    const char* shared = (char*)NULL;
+    const char* name = strrchr(argv[0], '/');
+    int daemon = 0, client = 0;
+    telemetry_format_t telemetry_format = TELEMETRY_JSON;
+    struct signalfd_siginfo ssi;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t ticks;
 
-    if (argc < 4) {
-        fprintf(stderr,
-            "Usage: %s <hot_threshold> <cool_threshold> <prog> <args ...>\n",
-            argv[0]
-        );
+    if (strcmp(name ? name + 1 : argv[0], "krund") == 0)
+        daemon = 1;
+    /* leading '+': stop at the first non-option, leaving <prog>'s own */
+    while ((opt = getopt_long(argc, argv, "+b:R:i:x:lc:C:tFaP:T:d:j:f:S:", long_options, NULL)) != -1) {
+        switch (opt) {
+          case 'b':
+            if (strcmp(optarg, "hwmon") == 0) {
+                backend = BACKEND_HWMON;
+#ifndef NO_LIBSENSORS
+            } else if (strcmp(optarg, "sensors") == 0) {
+                backend = BACKEND_SENSORS;
+#endif
+            } else {
+                fprintf(stderr, "Unknown sensor backend '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
+          case 'R':
+            hwmon_root = optarg;
+            backend = BACKEND_HWMON;
+            break;
+          case 'i':
+          case 'x':
+            sense_add_pattern(opt == 'i', optarg);
+            break;
+          case 'l':
+            list = 1;
+            break;
+          case OPT_SENSOR_CACHE:
+            sensor_cache = optarg[0] ? optarg : (char*)NULL;
+            cache_set = 1;
+            break;
+          case 'c':
+            if (strcmp(optarg, "freeze") == 0) {
+                throttle = THROTTLE_FREEZE;
+            } else if (strcmp(optarg, "cpumax") == 0) {
+                throttle = THROTTLE_CPUMAX;
+            } else {
+                fprintf(stderr, "Unknown cgroup mode '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
+          case 'C':
+            cgroup_parent = optarg;
+            if (throttle == THROTTLE_SIGNAL)
+                throttle = THROTTLE_FREEZE;
+            break;
+          case 't':
+            track = 1;
+            break;
+          case 'F':
+            cpufreq = 1;
+            break;
+          case OPT_CPU_ROOT:
+            cpu_root = optarg;
+            break;
+          case OPT_POWERCAP:
+            powercap = 1;
+            energy = 1;
+            break;
+          case OPT_ENERGY:
+            energy = 1;
+            break;
+          case OPT_POWERCAP_ROOT:
+            powercap_root = optarg;
+            break;
+          case 'a':
+            steer = 1;
+            break;
+          case 'P':
+            setpoint = strtod(optarg, (char**)NULL);
+            break;
+          case OPT_PID:
+            if (sscanf(optarg, "%lf,%lf,%lf", &control.pid.kp,
+                    &control.pid.ki, &control.pid.kd) != 3) {
+                fprintf(stderr, "Expected --pid=KP,KI,KD, got '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
+          case OPT_ADAPTIVE:
+            if (sscanf(optarg, "%lf,%lf", &sample_min, &sample_max) != 2
+                    || sample_min < 1.0 || sample_max < sample_min) {
+                fprintf(stderr, "Expected --adaptive=MIN,MAX with"
+                        " 1 <= MIN <= MAX, got '%s'\n", optarg);
+                exit(-1);
+            }
+            sample_min /= 1000;
+            sample_max /= 1000;
+            adaptive = 1;
+            break;
+          case OPT_PREDICT:
+            control.predict.horizon = strtod(optarg, (char**)NULL);
+            break;
+          case OPT_PREDICT_WINDOW:
+            control.predict.window = strtod(optarg, (char**)NULL);
+            if (control.predict.window <= 0.0) {
+                fprintf(stderr, "Prediction window must be positive\n");
+                exit(-1);
+            }
+            break;
+          case 'T':
+            if (control_add_tier(&control, optarg) != 0) {
+                fprintf(stderr, "Expected --tier=TEMP[/EXIT]:ACTION[,ACTION]"
+                        " with EXIT below TEMP, got '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
+          case 'd':
+            duty = strtod(optarg, (char**)NULL);
+            if (duty <= 0.0 || duty > 100.0) {
+                fprintf(stderr, "Duty %s must be above 0 and at most 100\n",
+                        optarg);
+                exit(-1);
+            }
+            break;
+          case OPT_PWM_PERIOD:
+            pwm_period_ns = (uint64_t)(strtod(optarg, (char**)NULL) * 1e6);
+            if (pwm_period_ns < 1000000) {
+                fprintf(stderr, "PWM period must be at least 1ms\n");
+                exit(-1);
+            }
+            break;
+          case 'j':
+            max_jobs = atoi(optarg);
+            if (max_jobs < 1) {
+                fprintf(stderr, "Number of jobs must be at least 1\n");
+                exit(-1);
+            }
+            break;
+          case 'f':
+            job_file = optarg;
+            break;
+          case OPT_ADMIT:
+            admit_threshold = strtod(optarg, (char**)NULL);
+            break;
+          case OPT_TELEMETRY:
+            telemetry = optarg;
+            break;
+          case OPT_TELEMETRY_FORMAT:
+            if (strcmp(optarg, "json") == 0) {
+                telemetry_format = TELEMETRY_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                telemetry_format = TELEMETRY_CSV;
+            } else {
+                fprintf(stderr, "Unknown telemetry format '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
+          case OPT_DAEMON:
+            daemon = 1;
+            break;
+          case OPT_CONNECT:
+            client = 1;
+            break;
+          case OPT_SOCKET:
+            socket_path = optarg;
+            break;
+          case OPT_SHARED:
+            shared = optarg ? optarg : "/dev/shm";
+            break;
+          case 'S':
+            simulate_secs = strtod(optarg, (char**)NULL);
+            break;
+          case OPT_PLANT:
+            if (sscanf(optarg, "%lf,%lf,%lf,%lf,%lf", &plant.ambient,
+                    &plant.sink_rise, &plant.sink_tau,
+                    &plant.die_rise, &plant.die_tau) != 5
+                    || plant.sink_tau <= 0.0 || plant.die_tau <= 0.0) {
+                fprintf(stderr, "Expected --plant=AMB,SR,ST,DR,DT"
+                        " with positive time constants, got '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
+          default:
+            usage(argv[0]);
+        }
+    }
+    if (!cache_set)
+        sensor_cache = default_sensor_cache();
+    if (list) {
+        sense_init();
+        sense_list();
+        sense_cleanup();
+        return 0;
+    }
+    if (client) {
+        /* no sensors or thresholds here: krund has those */
+        if (optind >= argc)
+            usage(argv[0]);
+        return client_run(socket_path ? socket_path
+                : daemon_default_socket(0), &argv[optind],
+                throttle != THROTTLE_SIGNAL);
+    }
+    if (daemon && (max_jobs > 0 || throttle != THROTTLE_SIGNAL || steer)) {
+        fprintf(stderr, "--daemon can't be combined with --jobs, --cgroup"
+                " or --affinity\n");
+        exit(-1);
+    }
+    if ((job_file == (char*)NULL) != (max_jobs == 0)) {
+        fprintf(stderr, "--jobs and --job-file must be given together\n");
         exit(-1);
     }
-    hot_threshold = strtod(argv[1], (char**)NULL);
+    if (argc - optind < (simulate_secs > 0.0 || max_jobs > 0 || daemon ? 2 : 3))
+        usage(argv[0]);
+    hot_threshold = strtod(argv[optind], (char**)NULL);
     if (hot_threshold > 90.0) {
         fprintf(stderr, "Hot threshold %f must not exceed 90\n", hot_threshold);
         exit(-1);
     }
-    cool_threshold = strtod(argv[2], (char**)NULL);
+    cool_threshold = strtod(argv[optind + 1], (char**)NULL);
     if (cool_threshold < 30.0) {
         fprintf(stderr,
                 "Cool threshold %f must be at least 30\n", cool_threshold);
@@ -232,44 +882,227 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Hot threshold must be more than cool threshold\n");
         exit(-1);
     }
+    if (cpufreq + powercap + (throttle == THROTTLE_CPUMAX) > 1) {
+        fprintf(stderr, "Only one of --cpufreq, --powercap and"
+                " --cgroup=cpumax may be given\n");
+        exit(-1);
+    }
+    if ((setpoint > 0.0) + (duty > 0.0) + (control.num_tiers > 0) > 1) {
+        fprintf(stderr, "Only one of --setpoint, --duty and --tier"
+                " may be given\n");
+        exit(-1);
+    }
+    if (control.num_tiers > 0) {
+        mode = CONTROL_TIERS;
+    } else if (duty > 0.0) {
+        mode = CONTROL_FIXED;
+    } else if (setpoint > 0.0) {
+        if (setpoint > hot_threshold) {
+            fprintf(stderr, "Setpoint must not exceed hot threshold\n");
+            exit(-1);
+        }
+        mode = CONTROL_PID;
+    } else if (throttle == THROTTLE_CPUMAX || cpufreq || powercap) {
+        mode = CONTROL_LINEAR;
+    }
+    control_init(&control, mode, hot_threshold, cool_threshold);
+    control.pid.setpoint = setpoint;
+    control.duty = duty / 100.0;
+    if (simulate_secs > 0.0) {
+        simulate(simulate_secs);
+        return 0;
+    }
+    if (max_jobs > 0) {
+        queue_load(job_file);
+        null_stdin = strcmp(job_file, "-") == 0;
+        if (admit_threshold == 0.0)
+            admit_threshold = (hot_threshold + cool_threshold) / 2;
+    }
 
     init();
-    si.si_status = 0;
-    child = start_child(argc - 3, &argv[3]);
-    while (1) {
-        t = detect_temp();
-        if (hot) {
-            if (hot_killed) {
-                printf("173 Ctrl-C detected while suspended"
-                        ", will kill child on resume\n");
-                hot_killed = 0;
-            }
-            if (t < cool_threshold) {
-                hot = 0;
-                printf("172 Temperature down to %.0f, resuming pid %ld\n",
-                        t, (long)child);
-                resume(child);
-            }
-        } else {
-            if (killed) {
-                printf("174 Ctrl-C detected, killing child\n");
-                killed = 0;
-                kill_child(child);
-            }
-            waited = waitid(P_PID, child, &si, WEXITED | WNOHANG);
-            if (waited != 0)
+    /* readings are stale once the sampler has missed a sample */
+    if (shared)
+        shm_init(shared, 2 * (cool_delay.tv_nsec / 1e9));
+    if (throttle != THROTTLE_SIGNAL)
+        cgroup_create(throttle == THROTTLE_CPUMAX);
+    /* a cgroup leaf already holds every descendant */
+    if (track && throttle == THROTTLE_SIGNAL) {
+        fd = track_init();
+        if (fd >= 0)
+            watch_fd(fd, EV_PROC);
+    } else
+        track = 0;
+    if (steer)
+        steer_init();
+    if (cpufreq)
+        cpufreq_init();
+    if (energy)
+        powercap_init(powercap);
+    if (telemetry)
+        telemetry_open(telemetry, telemetry_format);
+    if (daemon) {
+        listen_fd = daemon_listen(socket_path ? socket_path
+                : daemon_default_socket(1));
+        watch_fd(listen_fd, EV_LISTEN);
+    } else if (max_jobs == 0) {
+        start_child(&argv[optind + 2]);
+    }
+    set_sample_period(&cool_delay, 1);
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    while (num_jobs > 0 || ((queue_remaining() > 0 || listen_fd >= 0)
+            && !interrupted)) {
+        n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait failed, errno %d (%s)\n",
+                    errno, strerror(errno));
+            exit(-1);
+        }
+        for (i = 0; i < n; ++i) {
+            switch (events[i].data.u64 & 0xffffffff) {
+              case EV_TIMER:
+                (void)read(timer_fd, &ticks, sizeof(ticks));
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                dt = (now.tv_sec - last.tv_sec)
+                        + (now.tv_nsec - last.tv_nsec) / 1e9;
+                last = now;
+                account_energy();
+                /* t is 0 until the first sample, which reads them all */
+                if (adaptive && !steer && !control.hot_state && t > 0.0
+                        && hot_threshold - t > ADAPT_SWEEP_MARGIN)
+                    t = detect_temp_aggregate();
+                else
+                    t = detect_temp();
+                if (steer)
+                    t = steer_update(temperature_features,
+                            num_temperature_features,
+                            hot_threshold, cool_threshold);
+                hot = control.hot_state;
+                new_share = control_update(&control, t, dt);
+                if (control.hot_state && !hot) {
+                    if (t <= hot_threshold)
+                        printf("171 Temperature up to %.0f, rising %.1f/s,"
+                                " suspending %s\n", t, control.predict.slope,
+                                jobs_desc());
+                    else
+                        printf("171 Temperature up to %.0f, suspending %s\n",
+                                t, jobs_desc());
+                    /* the sampler for others keeps the faster pace */
+                    set_sample_period(shm_is_sampler()
+                            ? &cool_delay : &hot_delay, 0);
+                } else if (hot && !control.hot_state) {
+                    if (t >= cool_threshold)
+                        printf("172 Temperature down to %.0f, falling %.1f/s,"
+                                " resuming %s\n", t, -control.predict.slope,
+                                jobs_desc());
+                    else
+                        printf("172 Temperature down to %.0f, resuming %s\n",
+                                t, jobs_desc());
+                    set_sample_period(&cool_delay, 0);
+                    reported = 1.0;
+                } else if (mode == CONTROL_TIERS) {
+                    if (control.tier != tier) {
+                        printf("184 Temperature at %.0f, %s tier %d: %s\n",
+                                t, control.tier > tier ? "up to" : "down to",
+                                control.tier + 1, tier_desc(control.tier));
+                        tier = control.tier;
+                        if (tier < 0)
+                            sched_demote(0, 0);
+                        else
+                            sched_demote(control.tiers[tier].nice,
+                                    control.tiers[tier].idle);
+                    }
+                } else if (!hot && (new_share - reported >= 0.05
+                        || reported - new_share >= 0.05
+                        || (new_share == 1.0 && reported != 1.0))) {
+                    reported = new_share;
+                    printf("175 Temperature at %.0f, limiting %s"
+                            " to %.0f%% %s\n", t, jobs_desc(), new_share * 100,
+                            throttle == THROTTLE_CPUMAX ? "CPU"
+                            : cpufreq ? "frequency"
+                            : powercap ? "power" : "duty");
+                }
+                if (adaptive) {
+                    period.tv_sec = 0;
+                    period.tv_nsec = (long)(sample_period(t) * 1e9);
+                    while (period.tv_nsec >= 1000000000L) {
+                        ++period.tv_sec;
+                        period.tv_nsec -= 1000000000L;
+                    }
+                    set_sample_period(&period, 0);
+                }
+                apply_share(new_share);
+                if (telemetry)
+                    telemetry_record(control.hot_state ? "suspended"
+                            : new_share == 0.0 ? "stopped"
+                            : new_share < 1.0 ? "throttled" : "running",
+                            new_share);
+                if (hot && !control.hot_state && killed) {
+                    printf("174 Ctrl-C detected, killing %s\n", jobs_desc());
+                    killed = 0;
+                    jobs_signal(SIGKILL, 0);
+                }
+                /* ramp up by at most one job per sample, so we see the
+                 * effect of each before adding the next */
+                if (can_admit(t))
+                    start_queued();
+                break;
+              case EV_PWM:
+                (void)read(pwm_fd, &ticks, sizeof(ticks));
+                pwm_edge();
+                break;
+              case EV_SIGNAL:
+                if (read(signal_fd, &ssi, sizeof(ssi)) != sizeof(ssi))
+                    break;
+                if (ssi.ssi_signo == SIGCHLD) {
+                    status = reap_jobs(status);
+                    if (can_admit(t))
+                        start_queued();
+                    break;
+                }
+                interrupted = 1;
+                if (listen_fd >= 0) {
+                    /* the jobs are the clients', not ours to kill */
+                    printf("183 Signal received, releasing %s\n",
+                            jobs_desc());
+                    apply_share(1.0);
+                    if (tier >= 0)
+                        sched_demote(0, 0);
+                    while (num_jobs > 0)
+                        job_remove(&jobs[0]);
+                    break;
+                }
+                if (control.hot_state) {
+                    printf("173 Ctrl-C detected while suspended"
+                            ", will kill %s on resume\n", jobs_desc());
+                    killed = 1;
+                } else {
+                    printf("174 Ctrl-C detected, killing %s\n", jobs_desc());
+                    jobs_signal(SIGKILL, 0);
+                }
+                break;
+              case EV_LISTEN:
+                fd = accept4(listen_fd, (struct sockaddr*)NULL,
+                        (socklen_t*)NULL, SOCK_CLOEXEC);
+                if (fd >= 0)
+                    watch_fd(fd, ((uint64_t)fd << 32) | EV_CLIENT);
+                break;
+              case EV_PROC:
+                track_read();
+                break;
+              case EV_CLIENT:
+                daemon_read((int)(events[i].data.u64 >> 32), stopped);
+                break;
+              case EV_CHILD:
+                status = reap_jobs(status);
+                /* replace it straight away, if we would start one anyway */
+                if (can_admit(t))
+                    start_queued();
                 break;
-            if (t > hot_threshold) {
-                hot = 1;
-                printf("171 Temperature up to %.0f, suspending pid %ld\n",
-                        t, (long)child);
-                suspend(child);
             }
         }
-        (void)nanosleep(
-            hot ? &hot_delay : &cool_delay, (struct timespec *)NULL
-        );
     }
     cleanup();
-    return si.si_status;
+    return status;
 }
@@ -0,0 +1,214 @@
+#ifndef KRUN_H
+#define KRUN_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#ifndef NO_LIBSENSORS
+#include <sensors/sensors.h>
+#endif
+
+typedef struct feature_s {
+    const char* chip_name;
+    const char* feature_name;
+    const char* label;  /* as reported by the driver, or NULL */
+    int core;       /* the core_id this sensor measures, or -1 */
+#ifndef NO_LIBSENSORS
+    const sensors_chip_name* chip;
+    const sensors_feature* feature;
+    int subfeature_i;
+#endif
+    const char* path;   /* hwmon backend: <feature>_input */
+    int fd;         /* hwmon backend: open <feature>_input */
+    double scale;   /* hwmon backend: divisor from raw sysfs units */
+    double value;   /* the last reading */
+} feature_t;
+
+/* sense.c */
+typedef enum { BACKEND_SENSORS, BACKEND_HWMON } backend_t;
+extern backend_t backend;
+extern feature_t* temperature_features;
+extern int num_temperature_features;
+extern feature_t* fan_features;
+extern int num_fan_features;
+extern const char* sensor_cache;
+void sense_add_pattern(int include, const char* pattern);
+void sense_init(void);
+void sense_cleanup(void);
+void sense_list(void);
+int read_feature(feature_t* f, double* value);
+double detect_temp(void);
+double detect_temp_aggregate(void);
+void detect_fan(void);
+
+/* shm.c */
+void shm_init(const char* dir, double max_age);
+void shm_cleanup(void);
+int shm_is_sampler(void);
+int shm_fetch(void);
+void shm_publish(void);
+
+/* hwmon.c */
+typedef void (*hwmon_found_fn)(const char* chip, const char* feature,
+        const char* label, const char* path, int fan);
+extern const char* hwmon_root;
+void hwmon_discover(hwmon_found_fn found);
+int hwmon_open_feature(feature_t* f, double scale);
+int hwmon_read(feature_t* f, double* value);
+void hwmon_cleanup_feature(feature_t* f);
+
+/* cgroup.c */
+extern const char* cgroup_mount;
+extern const char* cgroup_parent;
+void cgroup_create(int want_cpu);
+void cgroup_enter(void);
+void cgroup_freeze(int frozen);
+void cgroup_set_quota(double fraction);
+void cgroup_destroy(void);
+FILE* cgroup_open_threads(void);
+int cgroup_freeze_at(const char* dir, int frozen);
+const char* cgroup_leaf(void);
+double cgroup_cpu_usage(void);
+
+/* jobs.c */
+typedef struct job_s {
+    pid_t pid;      /* also its process group */
+    int fd;         /* pidfd, or -1; for krund, the client's connection */
+    int id;         /* 1 for the first job started, and so on */
+    char* cgroup;   /* krund: the client's cgroup leaf, or NULL */
+    double energy;  /* joules of package energy attributed to it */
+} job_t;
+extern job_t* jobs;
+extern int num_jobs;
+extern int max_jobs;
+void queue_load(const char* file);
+int queue_remaining(void);
+const char* queue_next(void);
+job_t* job_add(pid_t pid, int fd);
+job_t* job_find(pid_t pid);
+void job_remove(job_t* j);
+void jobs_signal(int sig, int group);
+void job_suspend(job_t* j, int suspended);
+void jobs_suspend(int suspended);
+typedef void (*job_task_fn)(pid_t tid, void* arg);
+void jobs_each_task(job_task_fn fn, void* arg);
+const char* jobs_desc(void);
+
+/* sysfs.c */
+int sysfs_read(const char* path, char* buf, size_t len);
+int sysfs_write(const char* path, const char* value);
+void sysfs_set(const char* path, const char* value);
+int sysfs_save(const char* path, char* buf, size_t len);
+void sysfs_restore(void);
+
+/* cpufreq.c */
+void cpufreq_init(void);
+void cpufreq_set_share(double share);
+
+/* powercap.c */
+extern const char* powercap_root;
+void powercap_init(int cap);
+double powercap_energy(void);
+void powercap_set_share(double share);
+void powercap_cleanup(void);
+
+/* sched.c */
+void sched_demote(int nice, int idle);
+void sched_enter(void);
+
+/* track.c */
+int track_init(void);
+void track_add(pid_t pid);
+void track_remove(pid_t pid, int sig);
+void track_read(void);
+void track_rescan(void);
+int track_active(void);
+void track_each(job_task_fn fn, void* arg);
+void track_signal(int sig);
+void track_cleanup(void);
+
+/* telemetry.c */
+typedef enum { TELEMETRY_JSON, TELEMETRY_CSV } telemetry_format_t;
+void telemetry_open(const char* dest, telemetry_format_t format);
+void telemetry_record(const char* state, double share);
+void telemetry_close(void);
+
+/* daemon.c */
+const char* daemon_default_socket(int server);
+int daemon_listen(const char* path);
+void daemon_read(int fd, int suspended);
+void daemon_cleanup(int fd);
+int client_run(const char* path, char** argv, int use_cgroup);
+
+/* affinity.c */
+extern const char* cpu_root;
+void steer_init(void);
+void steer_enter(void);
+double steer_update(feature_t* features, int n, double hot, double cool);
+
+/* control.c */
+typedef enum {
+    CONTROL_HYSTERESIS, CONTROL_LINEAR, CONTROL_PID, CONTROL_FIXED,
+    CONTROL_TIERS
+} control_mode_t;
+
+#define PID_MIN_SHARE 0.02
+#define DEFAULT_KP 0.05
+#define DEFAULT_KI 0.01
+#define DEFAULT_KD 0.05
+
+typedef struct pid_ctl_s {
+    double setpoint;
+    double kp, ki, kd;  /* share per degree, per degree-second, per degree/s */
+    double integral;
+    double last_t;
+    int primed;         /* last_t is valid */
+} pid_ctl_t;
+
+#define MAX_TIERS 8
+#define DEFAULT_TIER_HYSTERESIS 3.0
+
+typedef struct tier_s {
+    double enter, exit; /* entered at or above enter, left below exit */
+    double share;       /* below 1 to duty-cycle, 0 to stop */
+    int nice;           /* demote the jobs to this nice value, or 0 */
+    int idle;           /* demote them to SCHED_IDLE */
+} tier_t;
+
+#define PREDICT_MAX 64
+#define DEFAULT_PREDICT_WINDOW 2.0
+
+typedef struct predict_s {
+    double horizon;     /* seconds to look ahead, or 0 to act only on t */
+    double window;      /* seconds of history to take the slope over */
+    double clock;       /* sum of dt so far */
+    double times[PREDICT_MAX], temps[PREDICT_MAX];
+    int first, n;       /* ring of the samples in the window */
+    double slope;       /* degrees per second, as of the last update */
+} predict_t;
+
+typedef struct control_s {
+    control_mode_t mode;
+    double hot, cool;
+    int hot_state;      /* suspended until below cool */
+    double duty;        /* share for CONTROL_FIXED */
+    pid_ctl_t pid;
+    predict_t predict;
+    tier_t tiers[MAX_TIERS];
+    int num_tiers;
+    int tier;           /* the tier we are in, or -1 */
+} control_t;
+
+typedef struct plant_s {
+    double ambient;
+    double sink_rise, sink_tau;
+    double die_rise, die_tau;
+    double sink, die;
+} plant_t;
+
+int control_add_tier(control_t* c, const char* spec);
+void control_init(control_t* c, control_mode_t mode, double hot, double cool);
+double control_update(control_t* c, double t, double dt);
+void plant_init(plant_t* p);
+double plant_step(plant_t* p, double share, double dt);
+
+#endif
@@ -0,0 +1,170 @@
+/* RAPL power capping and energy accounting.
+ *
+ * Temperature follows power only after seconds of thermal lag, but the
+ * package enforces a RAPL power limit within milliseconds. With a power
+ * cap, the temperature loop sets each package's long-term limit
+ * (constraint_0_power_limit_uw) in proportion to the share, from its
+ * original value down to POWERCAP_MIN_FRACTION of it, and the hardware
+ * does the fast inner loop. Original limits are saved with sysfs_save().
+ *
+ * Energy is read from each package's energy_uj, kept open and re-read
+ * with pread() like the hwmon sensors. The counter wraps at
+ * max_energy_range_uj.
+ *
+ * Only the top-level zones (intel-rapl:N, one per package) are used; the
+ * subzones for core, uncore and dram are parts of the same package, and
+ * would be counted twice.
+ */
+#include "krun.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_ZONES 64
+#define POWERCAP_MIN_FRACTION 0.2
+
+typedef struct zone_s {
+    int energy_fd;
+    uint64_t range_uj;      /* energy_uj wraps to 0 at this */
+    uint64_t last_uj;
+    char limit_path[PATH_MAX];
+    char limit_orig[32];
+    long limit_uw;          /* original limit */
+} zone_t;
+
+const char* powercap_root = "/sys/class/powercap";
+static zone_t zones[MAX_ZONES];
+static int num_zones = 0;
+static double current = 1.0;    /* share last put into effect */
+
+static int read_energy(zone_t* z, uint64_t* uj) {
+    char buf[32];
+    ssize_t n = pread(z->energy_fd, buf, sizeof(buf) - 1, 0);
+
+    if (n <= 0)
+        return n < 0 ? errno : EINVAL;
+    buf[n] = '\0';
+    *uj = strtoull(buf, (char**)NULL, 10);
+    return 0;
+}
+
+static void add_zone(const char* dir, int cap) {
+    char path[PATH_MAX], buf[32];
+    zone_t* z = &zones[num_zones];
+    int rc;
+
+    snprintf(path, sizeof(path), "%s/energy_uj", dir);
+    z->energy_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (z->energy_fd < 0) {
+        /* readable only by root on most kernels since 5.10 */
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        exit(-1);
+    }
+    snprintf(path, sizeof(path), "%s/max_energy_range_uj", dir);
+    z->range_uj = sysfs_read(path, buf, sizeof(buf)) == 0
+            ? strtoull(buf, (char**)NULL, 10) : 0;
+    rc = read_energy(z, &z->last_uj);
+    if (rc != 0) {
+        fprintf(stderr, "Unable to read %s/energy_uj: %s\n",
+                dir, strerror(rc));
+        exit(-1);
+    }
+    z->limit_path[0] = '\0';
+    if (cap) {
+        snprintf(z->limit_path, sizeof(z->limit_path),
+                "%s/constraint_0_power_limit_uw", dir);
+        rc = sysfs_save(z->limit_path, z->limit_orig, sizeof(z->limit_orig));
+        if (rc != 0) {
+            fprintf(stderr, "Unable to read %s: %s\n",
+                    z->limit_path, strerror(rc));
+            exit(-1);
+        }
+        z->limit_uw = atol(z->limit_orig);
+    }
+    ++num_zones;
+}
+
+/* Find the packages' RAPL zones and start counting their energy; if cap
+ * is TRUE, also take over their power limits. */
+void powercap_init(int cap) {
+    char path[PATH_MAX];
+    struct dirent* de;
+    DIR* d;
+    int n;
+
+    d = opendir(powercap_root);
+    if (d == (DIR*)NULL) {
+        fprintf(stderr, "Unable to read %s: %s\n",
+                powercap_root, strerror(errno));
+        exit(-1);
+    }
+    while ((de = readdir(d)) != (struct dirent*)NULL
+            && num_zones < MAX_ZONES) {
+        n = 0;
+        if (sscanf(de->d_name, "intel-rapl:%*d%n", &n) != 0
+                || n == 0 || de->d_name[n] != '\0')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", powercap_root, de->d_name);
+        add_zone(path, cap);
+    }
+    closedir(d);
+    if (num_zones == 0) {
+        fprintf(stderr, "No RAPL zones found in %s\n", powercap_root);
+        exit(-1);
+    }
+}
+
+/* joules used by all packages since the last call */
+double powercap_energy(void) {
+    uint64_t uj, total = 0;
+    int i;
+
+    for (i = 0; i < num_zones; ++i) {
+        zone_t* z = &zones[i];
+        if (read_energy(z, &uj) != 0)
+            continue;
+        if (uj >= z->last_uj)
+            total += uj - z->last_uj;
+        else if (z->range_uj > z->last_uj)
+            total += z->range_uj - z->last_uj + uj;
+        z->last_uj = uj;
+    }
+    return total / 1e6;
+}
+
+/* Cap each package at the given share of its original power limit. */
+void powercap_set_share(double share) {
+    char value[32];
+    int i;
+
+    if (share == current)
+        return;
+    current = share;
+    for (i = 0; i < num_zones; ++i) {
+        zone_t* z = &zones[i];
+        if (z->limit_path[0] == '\0')
+            continue;
+        if (share >= 1.0) {
+            sysfs_set(z->limit_path, z->limit_orig);
+            continue;
+        }
+        snprintf(value, sizeof(value), "%ld\n", (long)(z->limit_uw
+                * (POWERCAP_MIN_FRACTION
+                        + (1.0 - POWERCAP_MIN_FRACTION) * share)));
+        sysfs_set(z->limit_path, value);
+    }
+}
+
+void powercap_cleanup(void) {
+    int i;
+
+    for (i = 0; i < num_zones; ++i)
+        close(zones[i].energy_fd);
+    num_zones = 0;
+}
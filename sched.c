@@ -0,0 +1,137 @@
+/* Scheduling demotion, the gentlest throttling tiers.
+ *
+ * Before duty-cycling or stopping the jobs, we can make them give way:
+ * raise their nice value, or move them to SCHED_IDLE, so that they only
+ * get CPU time nothing else wants. Each task's policy and nice value are
+ * saved when it is first seen, and put back when the demotion is lifted.
+ * Tasks first seen while demoted will have inherited the demotion, so
+ * they get back krun's own settings, which they would otherwise have
+ * inherited instead.
+ *
+ * Raising priority back up needs CAP_SYS_NICE, or a high enough
+ * RLIMIT_NICE, so without them the restore can fail.
+ */
+#define _GNU_SOURCE
+#include "krun.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+typedef struct sched_saved_s {
+    pid_t tid;
+    int policy;
+    struct sched_param param;
+    int nice;
+} sched_saved_t;
+
+typedef struct demotion_s {
+    int nice;       /* at least this nice value */
+    int idle;       /* SCHED_IDLE */
+    int failed;     /* a change was refused */
+} demotion_t;
+
+static sched_saved_t* saved = (sched_saved_t*)NULL;
+static int num_saved = 0, saved_size = 0;
+static sched_saved_t base;      /* krun's own settings */
+static int demoted = 0;
+static demotion_t current;      /* as last applied */
+
+static void save_current(sched_saved_t* s, pid_t tid) {
+    s->tid = tid;
+    s->policy = sched_getscheduler(tid);
+    sched_getparam(tid, &s->param);
+    errno = 0;
+    s->nice = getpriority(PRIO_PROCESS, tid);
+}
+
+static sched_saved_t* find_saved(pid_t tid) {
+    int i;
+
+    for (i = 0; i < num_saved; ++i) {
+        if (saved[i].tid == tid)
+            return &saved[i];
+    }
+    if (num_saved == saved_size) {
+        saved_size = saved_size ? saved_size * 2 : 64;
+        saved = realloc(saved, saved_size * sizeof(sched_saved_t));
+        if (saved == (sched_saved_t*)NULL) {
+            fprintf(stderr, "Out of memory for scheduling state\n");
+            exit(-1);
+        }
+    }
+    if (demoted) {
+        saved[num_saved] = base;
+        saved[num_saved].tid = tid;
+    } else {
+        save_current(&saved[num_saved], tid);
+    }
+    return &saved[num_saved++];
+}
+
+static void demote_task(pid_t tid, void* arg) {
+    demotion_t* d = (demotion_t*)arg;
+    sched_saved_t* orig;
+    sched_saved_t now;
+    struct sched_param idle_param;
+    int nice;
+
+    save_current(&now, tid);
+    if (now.policy < 0)
+        return;     /* it has gone */
+    orig = find_saved(tid);
+    nice = d->nice > orig->nice ? d->nice : orig->nice;
+    if (d->idle) {
+        if (now.policy != SCHED_IDLE) {
+            memset(&idle_param, 0, sizeof(idle_param));
+            if (sched_setscheduler(tid, SCHED_IDLE, &idle_param) != 0
+                    && errno != ESRCH)
+                d->failed = errno;
+        }
+    } else if (now.policy != orig->policy
+            || now.param.sched_priority != orig->param.sched_priority) {
+        if (sched_setscheduler(tid, orig->policy, &orig->param) != 0
+                && errno != ESRCH)
+            d->failed = errno;
+    }
+    if (now.nice != nice && setpriority(PRIO_PROCESS, tid, nice) != 0
+            && errno != ESRCH)
+        d->failed = errno;
+}
+
+/* Demote every task of every job to at least the given nice value and,
+ * if idle is TRUE, to SCHED_IDLE; with neither, put them all back as
+ * they were. */
+void sched_demote(int nice, int idle) {
+    demotion_t d;
+
+    if (!demoted && num_saved == 0)
+        save_current(&base, 0);
+    d.nice = nice;
+    d.idle = idle;
+    d.failed = 0;
+    jobs_each_task(demote_task, &d);
+    if (d.failed)
+        fprintf(stderr, "Could not change the jobs' scheduling, errno %d (%s)\n",
+                d.failed, strerror(d.failed));
+    demoted = nice > 0 || idle;
+    current = d;
+    if (!demoted)
+        num_saved = 0;      /* forget tasks that have since exited */
+}
+
+/* called in a new job before exec, to start it demoted like the others */
+void sched_enter(void) {
+    struct sched_param idle_param;
+
+    if (!demoted)
+        return;
+    if (current.nice > 0)
+        setpriority(PRIO_PROCESS, 0, current.nice);
+    if (current.idle) {
+        memset(&idle_param, 0, sizeof(idle_param));
+        sched_setscheduler(0, SCHED_IDLE, &idle_param);
+    }
+}
@@ -0,0 +1,461 @@
+/* Sensor discovery, selection and reading.
+ *
+ * At startup every temperature and fan input is discovered, through
+ * libsensors or by walking the hwmon tree, and filtered by include and
+ * exclude patterns. Patterns are shell globs matched against
+ * "chip:feature" and "chip:label" (such as "coretemp-*:Core *"), or
+ * against the chip name alone if they contain no ':'. With no include
+ * patterns we take the temperatures of the known CPU drivers, or every
+ * temperature if there are none of those, and every fan.
+ *
+ * For the hwmon backend the resolved set is cached, so later runs with
+ * the same patterns can open the files directly; each cached file is
+ * checked to still belong to its chip, and any mismatch means
+ * rediscovery. libsensors does its own full scan in sensors_init(), so
+ * there is nothing to gain from caching its results.
+ */
+#include "krun.h"
+#ifndef NO_LIBSENSORS
+#include <sensors/error.h>
+#endif
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_VERSION "krun-sensors 1"
+
+#ifdef NO_LIBSENSORS
+backend_t backend = BACKEND_HWMON;
+#else
+backend_t backend = BACKEND_SENSORS;
+#endif
+
+feature_t* temperature_features = (feature_t*)NULL;
+int num_temperature_features = 0;
+feature_t* fan_features = (feature_t*)NULL;
+int num_fan_features = 0;
+const char* sensor_cache = (char*)NULL;
+
+static const char* default_includes[] = {
+    "coretemp", "k10temp", "zenpower", "cpu_thermal", (char*)NULL
+};
+static const char** includes = (const char**)NULL;
+static int num_includes = 0;
+static const char** excludes = (const char**)NULL;
+static int num_excludes = 0;
+
+void sense_add_pattern(int include, const char* pattern) {
+    if (include) {
+        includes = realloc(includes, ++num_includes * sizeof(char*));
+        includes[num_includes - 1] = pattern;
+    } else {
+        excludes = realloc(excludes, ++num_excludes * sizeof(char*));
+        excludes[num_excludes - 1] = pattern;
+    }
+}
+
+static int pattern_matches(const char* pattern, const feature_t* f) {
+    char name[256];
+
+    if (strchr(pattern, ':') == (char*)NULL)
+        return fnmatch(pattern, f->chip_name, 0) == 0;
+    snprintf(name, sizeof(name), "%s:%s", f->chip_name, f->feature_name);
+    if (fnmatch(pattern, name, 0) == 0)
+        return 1;
+    if (f->label == (char*)NULL)
+        return 0;
+    snprintf(name, sizeof(name), "%s:%s", f->chip_name, f->label);
+    return fnmatch(pattern, name, 0) == 0;
+}
+
+static int any_matches(const char** patterns, int n, const feature_t* f) {
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (pattern_matches(patterns[i], f))
+            return 1;
+    }
+    return 0;
+}
+
+static int is_cpu_sensor(const feature_t* f) {
+    int i;
+    size_t len;
+
+    for (i = 0; default_includes[i]; ++i) {
+        len = strlen(default_includes[i]);
+        if (strncmp(f->chip_name, default_includes[i], len) == 0
+                && f->chip_name[len] == '-')
+            return 1;
+    }
+    return 0;
+}
+
+/* append a copy of *f to the temperature or fan list */
+static feature_t* add_feature(int fan, const feature_t* f) {
+    feature_t** list = fan ? &fan_features : &temperature_features;
+    int* n = fan ? &num_fan_features : &num_temperature_features;
+    feature_t* copy;
+
+    *list = realloc(*list, (*n + 1) * sizeof(feature_t));
+    if (*list == (feature_t*)NULL) {
+        fprintf(stderr, "Out of memory for sensor list\n");
+        exit(-1);
+    }
+    copy = &(*list)[(*n)++];
+    *copy = *f;
+    copy->chip_name = strdup(f->chip_name);
+    copy->feature_name = strdup(f->feature_name);
+    copy->label = f->label ? strdup(f->label) : (char*)NULL;
+    copy->path = f->path ? strdup(f->path) : (char*)NULL;
+    copy->fd = -1;
+    if (copy->label == (char*)NULL
+            || sscanf(copy->label, "Core %d", &copy->core) != 1)
+        copy->core = -1;
+    return copy;
+}
+
+static void free_feature(feature_t* f) {
+    if (backend == BACKEND_HWMON)
+        hwmon_cleanup_feature(f);
+    free((char*)f->chip_name);
+    free((char*)f->feature_name);
+    free((char*)f->label);
+    free((char*)f->path);
+}
+
+/* Keep the features that pass the patterns, dropping the rest. */
+static void select_features(feature_t** list, int* n, int fan) {
+    feature_t* all = *list;
+    int i, kept = 0, cpu = 0;
+
+    if (!fan && num_includes == 0) {
+        for (i = 0; i < *n; ++i)
+            cpu |= is_cpu_sensor(&all[i]);
+    }
+    for (i = 0; i < *n; ++i) {
+        feature_t* f = &all[i];
+        int keep;
+
+        if (num_includes > 0)
+            keep = any_matches(includes, num_includes, f);
+        else
+            keep = fan || !cpu || is_cpu_sensor(f);
+        if (keep && any_matches(excludes, num_excludes, f))
+            keep = 0;
+        if (keep)
+            all[kept++] = *f;
+        else
+            free_feature(f);
+    }
+    *n = kept;
+}
+
+static void hwmon_found(const char* chip, const char* feature,
+        const char* label, const char* path, int fan) {
+    feature_t f;
+
+    memset(&f, 0, sizeof(f));
+    f.chip_name = chip;
+    f.feature_name = feature;
+    f.label = label;
+    f.path = path;
+    add_feature(fan, &f);
+}
+
+#ifndef NO_LIBSENSORS
+static void discover_sensors(void) {
+    const sensors_chip_name* chip;
+    const sensors_feature* feature;
+    const sensors_subfeature* sf;
+    feature_t f;
+    char name[128];
+    int sci = 0, sfi, fan;
+
+    while ((chip = sensors_get_detected_chips(NULL, &sci))
+            != (sensors_chip_name*)NULL) {
+        if (sensors_snprintf_chip_name(name, sizeof(name), chip) < 0)
+            continue;
+        sfi = 0;
+        while ((feature = sensors_get_features(chip, &sfi))
+                != (sensors_feature*)NULL) {
+            if (feature->type == SENSORS_FEATURE_TEMP) {
+                fan = 0;
+                sf = sensors_get_subfeature(chip, feature,
+                        SENSORS_SUBFEATURE_TEMP_INPUT);
+            } else if (feature->type == SENSORS_FEATURE_FAN) {
+                fan = 1;
+                sf = sensors_get_subfeature(chip, feature,
+                        SENSORS_SUBFEATURE_FAN_INPUT);
+            } else {
+                continue;
+            }
+            if (sf == (sensors_subfeature*)NULL)
+                continue;
+            memset(&f, 0, sizeof(f));
+            f.chip_name = name;
+            f.feature_name = feature->name;
+            f.label = sensors_get_label(chip, feature);
+            f.chip = chip;
+            f.feature = feature;
+            f.subfeature_i = sf->number;
+            add_feature(fan, &f);
+            free((char*)f.label);
+        }
+    }
+}
+#endif
+
+/* the key identifying what a cache file was built for */
+static void cache_key(FILE* fp) {
+    int i;
+
+    fprintf(fp, "%s %s\n", CACHE_VERSION, hwmon_root);
+    for (i = 0; i < num_includes; ++i)
+        fprintf(fp, "include %s\n", includes[i]);
+    for (i = 0; i < num_excludes; ++i)
+        fprintf(fp, "exclude %s\n", excludes[i]);
+}
+
+/* Cache lines are "temp|fan <chip> <feature> <path>[ <label>]"; labels
+ * may contain spaces, but chip names, features and paths do not. */
+static int load_cache(void) {
+    char key[4096], line[1024], type[8], chip[256], feature[64];
+    char path[512], *label;
+    FILE *fp, *kp;
+    size_t klen;
+    int n, i;
+
+    fp = fopen(sensor_cache, "r");
+    if (fp == (FILE*)NULL)
+        return 0;
+    kp = fmemopen(key, sizeof(key), "w");
+    cache_key(kp);
+    fclose(kp);
+    klen = strlen(key);
+    if (fread(line, 1, klen, fp) != klen || memcmp(line, key, klen) != 0) {
+        fclose(fp);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        n = 0;
+        if (sscanf(line, "%7s %255s %63s %511s%n",
+                type, chip, feature, path, &n) != 4)
+            break;
+        label = line[n] == ' ' ? &line[n + 1] : (char*)NULL;
+        hwmon_found(chip, feature, label, path, strcmp(type, "fan") == 0);
+    }
+    fclose(fp);
+
+    for (i = 0; i < num_temperature_features; ++i) {
+        if (hwmon_open_feature(&temperature_features[i], 1000.0) != 0)
+            return 0;
+    }
+    for (i = 0; i < num_fan_features; ++i) {
+        if (hwmon_open_feature(&fan_features[i], 1.0) != 0)
+            return 0;
+    }
+    return num_temperature_features > 0;
+}
+
+static void save_cache(void) {
+    char tmp[4096];
+    FILE* fp;
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.%ld", sensor_cache, (long)getpid());
+    fp = fopen(tmp, "w");
+    if (fp == (FILE*)NULL)
+        return;     /* it's only a cache */
+    cache_key(fp);
+    for (i = 0; i < num_temperature_features + num_fan_features; ++i) {
+        int fan = i >= num_temperature_features;
+        feature_t* f = fan ? &fan_features[i - num_temperature_features]
+                : &temperature_features[i];
+        fprintf(fp, "%s %s %s %s%s%s\n", fan ? "fan" : "temp",
+                f->chip_name, f->feature_name, f->path,
+                f->label ? " " : "", f->label ? f->label : "");
+    }
+    if (fclose(fp) != 0 || rename(tmp, sensor_cache) != 0)
+        unlink(tmp);
+}
+
+static void free_features(void) {
+    int i;
+
+    for (i = 0; i < num_temperature_features + num_fan_features; ++i) {
+        feature_t* f = i < num_temperature_features
+                ? &temperature_features[i]
+                : &fan_features[i - num_temperature_features];
+        free_feature(f);
+    }
+    free(temperature_features);
+    free(fan_features);
+    temperature_features = fan_features = (feature_t*)NULL;
+    num_temperature_features = num_fan_features = 0;
+}
+
+void sense_init(void) {
+    int i, rc;
+
+    if (backend == BACKEND_HWMON) {
+        if (sensor_cache && load_cache())
+            return;
+        free_features();
+        hwmon_discover(hwmon_found);
+    } else {
+#ifndef NO_LIBSENSORS
+        /* /usr/bin/sensors source passes NULL for default, I assume that's ok */
+        rc = sensors_init((FILE*)NULL);
+        if (rc != 0) {
+            fprintf(stderr, "sensors_init() error (%d): %s\n",
+                    rc, sensors_strerror(rc));
+            exit(-1);
+        }
+        discover_sensors();
+#endif
+    }
+    select_features(&temperature_features, &num_temperature_features, 0);
+    select_features(&fan_features, &num_fan_features, 1);
+    if (num_temperature_features == 0) {
+        fprintf(stderr, "No temperature sensors found to monitor\n");
+        exit(-1);
+    }
+    if (backend != BACKEND_HWMON)
+        return;
+
+    /* temperatures are in millidegrees C, fans in RPM */
+    for (i = 0; i < num_temperature_features + num_fan_features; ++i) {
+        int fan = i >= num_temperature_features;
+        feature_t* f = fan ? &fan_features[i - num_temperature_features]
+                : &temperature_features[i];
+        rc = hwmon_open_feature(f, fan ? 1.0 : 1000.0);
+        if (rc != 0) {
+            fprintf(stderr, "Unable to open %s for %s:%s (%d): %s\n",
+                    f->path, f->chip_name, f->feature_name, rc, strerror(rc));
+            exit(-1);
+        }
+    }
+    if (sensor_cache)
+        save_cache();
+}
+
+void sense_cleanup(void) {
+    free_features();
+#ifndef NO_LIBSENSORS
+    if (backend == BACKEND_SENSORS)
+        sensors_cleanup();
+#endif
+}
+
+/* print the selected sensors with their current readings */
+void sense_list(void) {
+    double value;
+    int i;
+
+    for (i = 0; i < num_temperature_features + num_fan_features; ++i) {
+        int fan = i >= num_temperature_features;
+        feature_t* f = fan ? &fan_features[i - num_temperature_features]
+                : &temperature_features[i];
+        read_feature(f, &value);
+        printf("%s:%s\t%s\t%.1f%s\n", f->chip_name, f->feature_name,
+                f->label ? f->label : "", value, fan ? " RPM" : "C");
+    }
+}
+
+/* returns 0 on success, else prints the failure and exits */
+int read_feature(feature_t* f, double* value) {
+    int rc;
+
+    if (backend == BACKEND_HWMON) {
+        rc = hwmon_read(f, value);
+        if (rc != 0) {
+            fprintf(stderr, "Unable to read value for %s:%s (%d): %s\n",
+                    f->chip_name, f->feature_name, rc, strerror(rc));
+            exit(-1);
+        }
+        return 0;
+    }
+#ifndef NO_LIBSENSORS
+    rc = sensors_get_value(f->chip, f->subfeature_i, value);
+    if (rc != 0) {
+        fprintf(stderr, "Unable to read value for %s:%s (%d): %s\n",
+                f->chip_name, f->feature_name, rc, sensors_strerror(rc));
+        exit(-1);
+    }
+#endif
+    return 0;
+}
+
+/* the hottest of the temperature features' current values */
+static double max_value(void) {
+    int i;
+    double max = -1.0;
+
+    for (i = 0; i < num_temperature_features; ++i) {
+        if (temperature_features[i].value > max)
+            max = temperature_features[i].value;
+    }
+    return max;
+}
+
+/* Read every temperature, or take them from the shared page when another
+ * krun is sampling them. */
+double detect_temp(void) {
+    int i;
+    double value;
+
+    if (shm_fetch())
+        return max_value();
+    for (i = 0; i < num_temperature_features; ++i) {
+        read_feature(&temperature_features[i], &value);
+        temperature_features[i].value = value;
+    }
+    shm_publish();
+    return max_value();
+}
+
+/* The hottest of the package and die sensors, skipping the per-core ones:
+ * a much cheaper read on machines with many cores, for when we are far
+ * from the limit. If there are only per-core sensors, or none of them,
+ * this is just detect_temp(); likewise for the sampler of a shared page,
+ * since others rely on all of its readings. */
+double detect_temp_aggregate(void) {
+    int i, cores = 0, others = 0;
+    double value;
+    double max = -1.0;
+
+    if (shm_fetch())
+        return max_value();
+
+    for (i = 0; i < num_temperature_features; ++i) {
+        if (temperature_features[i].core >= 0)
+            ++cores;
+        else
+            ++others;
+    }
+    if (cores == 0 || others == 0 || shm_is_sampler())
+        return detect_temp();
+    for (i = 0; i < num_temperature_features; ++i) {
+        feature_t* f = &temperature_features[i];
+        if (f->core >= 0)
+            continue;
+        read_feature(f, &value);
+        f->value = value;
+        if (value > max)
+            max = value;
+    }
+    return max;
+}
+
+/* read every fan into its feature's value */
+void detect_fan(void) {
+    int i;
+
+    for (i = 0; i < num_fan_features; ++i)
+        read_feature(&fan_features[i], &fan_features[i].value);
+}
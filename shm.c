@@ -0,0 +1,180 @@
+/* Sharing sensor readings between krun instances.
+ *
+ * With --shared, the instances on a machine monitoring the same sensors
+ * share one page of memory, a file in /dev/shm named for the user and a
+ * hash of the sensor set. Whichever instance holds an exclusive flock()
+ * on the file is the sampler: it reads the sensors and publishes the
+ * readings there, with the time they were taken and a generation count.
+ * The others copy them out without touching sysfs at all.
+ *
+ * The page is protected by a seqlock: the sampler makes seq odd, writes,
+ * then makes it even again, and a reader retries if seq was odd or
+ * changed while it copied. Readers never block the sampler, nor it them.
+ *
+ * The lock goes with the sampler's file descriptor, so if it exits or
+ * dies another instance takes over at its next sample. Until then, or
+ * if the sampler has stalled, readers find the page stale and read the
+ * sensors themselves.
+ */
+#include "krun.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x6b72756e    /* "krun" */
+#define SHM_MAX_FEATURES 256
+#define SHM_MAX_RETRIES 1000
+
+typedef struct shm_page_s {
+    uint32_t magic;
+    uint32_t seq;           /* odd while being written */
+    uint64_t key;           /* hash of the sensor set */
+    uint64_t generation;    /* samples published so far */
+    uint64_t time_ns;       /* CLOCK_MONOTONIC of the readings */
+    uint32_t n;
+    double values[SHM_MAX_FEATURES];
+} shm_page_t;
+
+static int shm_fd = -1;
+static shm_page_t* page = (shm_page_t*)NULL;
+static uint64_t key;
+static int sampler = 0;
+static uint64_t max_age_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a over the backend, root and selected sensors, in order */
+static uint64_t sensor_key(void) {
+    uint64_t h = 14695981039346656037ULL;
+    char buf[512];
+    const char* p;
+    int i;
+
+    snprintf(buf, sizeof(buf), "%d %s", (int)backend, hwmon_root);
+    for (i = -1; i < num_temperature_features; ++i) {
+        if (i >= 0)
+            snprintf(buf, sizeof(buf), "%s:%s",
+                    temperature_features[i].chip_name,
+                    temperature_features[i].feature_name);
+        for (p = buf; *p; ++p)
+            h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+        h = (h ^ '\n') * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Map the page for the current sensor set in dir, and stand for sampler.
+ * Readings older than max_age seconds are not used. */
+void shm_init(const char* dir, double max_age) {
+    char path[PATH_MAX];
+
+    if (num_temperature_features > SHM_MAX_FEATURES) {
+        fprintf(stderr, "Too many sensors to share, reading them directly\n");
+        return;
+    }
+    key = sensor_key();
+    max_age_ns = (uint64_t)(max_age * 1e9);
+    snprintf(path, sizeof(path), "%s/krun-sensors.%ld.%016llx",
+            dir, (long)getuid(), (unsigned long long)key);
+    shm_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (shm_fd < 0 || ftruncate(shm_fd, sizeof(shm_page_t)) != 0) {
+        fprintf(stderr, "Unable to open shared page %s: %s\n",
+                path, strerror(errno));
+        exit(-1);
+    }
+    page = mmap((void*)NULL, sizeof(shm_page_t), PROT_READ | PROT_WRITE,
+            MAP_SHARED, shm_fd, 0);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "Unable to map shared page %s: %s\n",
+                path, strerror(errno));
+        exit(-1);
+    }
+    sampler = flock(shm_fd, LOCK_EX | LOCK_NB) == 0;
+}
+
+void shm_cleanup(void) {
+    if (page != (shm_page_t*)NULL)
+        munmap(page, sizeof(shm_page_t));
+    if (shm_fd >= 0)
+        close(shm_fd);      /* releases the lock for the next sampler */
+    page = (shm_page_t*)NULL;
+    shm_fd = -1;
+    sampler = 0;
+}
+
+int shm_is_sampler(void) {
+    return sampler;
+}
+
+/* Fill in the temperature features' values from the page, returning
+ * TRUE, if it has fresh readings; else we should read the sensors
+ * ourselves, and may have just become the sampler. */
+int shm_fetch(void) {
+    double values[SHM_MAX_FEATURES];
+    uint32_t seq, n;
+    uint64_t time_ns;
+    int i, tries = 0;
+
+    if (page == (shm_page_t*)NULL || sampler)
+        return 0;
+    if (flock(shm_fd, LOCK_EX | LOCK_NB) == 0) {
+        sampler = 1;        /* the last one has gone */
+        return 0;
+    }
+    do {
+        /* a sampler killed mid-write would leave seq odd until the next
+         * one takes over */
+        if (++tries > SHM_MAX_RETRIES)
+            return 0;
+        seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        n = page->n;
+        time_ns = page->time_ns;
+        if (page->magic != SHM_MAGIC || page->key != key
+                || n != (uint32_t)num_temperature_features)
+            return 0;
+        memcpy(values, page->values, n * sizeof(double));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+
+    if (now_ns() - time_ns > max_age_ns)
+        return 0;
+    for (i = 0; i < (int)n; ++i)
+        temperature_features[i].value = values[i];
+    return 1;
+}
+
+/* as the sampler, publish the temperature features' latest values */
+void shm_publish(void) {
+    uint32_t seq;
+    int i;
+
+    if (!sampler)
+        return;
+    /* even, unless the last sampler died while writing */
+    seq = (page->seq + 1) | 1;
+    __atomic_store_n(&page->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    page->magic = SHM_MAGIC;
+    page->key = key;
+    page->n = num_temperature_features;
+    for (i = 0; i < num_temperature_features; ++i)
+        page->values[i] = temperature_features[i].value;
+    page->time_ns = now_ns();
+    ++page->generation;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,107 @@
+/* Reading and writing sysfs settings, and putting back those we change.
+ *
+ * Actuators that retune the machine (cpufreq, powercap) call sysfs_save()
+ * on each setting before first changing it. Every saved setting is
+ * written back at exit, including after exit() on an error and on fatal
+ * signals: leaving a machine throttled would be much worse than anything
+ * krun protects against. Everything the restore needs is prepared when
+ * saving, so it is safe in a signal handler.
+ */
+#include "krun.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SAVED 1024
+
+typedef struct saved_s {
+    char* path;
+    char value[32];
+} saved_t;
+
+static saved_t* saved[MAX_SAVED];
+static volatile sig_atomic_t num_saved = 0;
+
+int sysfs_read(const char* path, char* buf, size_t len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd < 0)
+        return errno;
+    n = read(fd, buf, len - 1);
+    close(fd);
+    if (n <= 0)
+        return n < 0 ? errno : EINVAL;
+    buf[n] = '\0';
+    return 0;
+}
+
+/* async-signal-safe */
+int sysfs_write(const char* path, const char* value) {
+    int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC), rc = 0;
+    size_t len = strlen(value);
+
+    if (fd < 0)
+        return errno;
+    if (write(fd, value, len) != (ssize_t)len)
+        rc = errno;
+    close(fd);
+    return rc;
+}
+
+/* sysfs_write(), complaining on failure */
+void sysfs_set(const char* path, const char* value) {
+    int rc = sysfs_write(path, value);
+    if (rc != 0)
+        fprintf(stderr, "Could not write %s, errno %d (%s)\n",
+                path, rc, strerror(rc));
+}
+
+static void restore_on_signal(int sig) {
+    sysfs_restore();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Read the current value of path into buf, and remember it to restore
+ * at exit. Returns 0 on success, else an errno. */
+int sysfs_save(const char* path, char* buf, size_t len) {
+    static const int fatal[] = {
+        SIGHUP, SIGQUIT, SIGILL, SIGABRT, SIGBUS, SIGFPE, SIGSEGV, 0
+    };
+    saved_t* s;
+    int i, rc;
+
+    if (num_saved == MAX_SAVED)
+        return ENOSPC;
+    s = malloc(sizeof(saved_t));
+    if (s == (saved_t*)NULL)
+        return ENOMEM;
+    rc = sysfs_read(path, s->value, sizeof(s->value));
+    if (rc != 0) {
+        free(s);
+        return rc;
+    }
+    s->path = strdup(path);
+    snprintf(buf, len, "%s", s->value);
+    if (num_saved == 0) {
+        atexit(sysfs_restore);
+        for (i = 0; fatal[i]; ++i)
+            signal(fatal[i], restore_on_signal);
+    }
+    saved[num_saved] = s;
+    ++num_saved;
+    return 0;
+}
+
+/* Write back every saved setting; async-signal-safe. */
+void sysfs_restore(void) {
+    int i;
+
+    for (i = 0; i < num_saved; ++i)
+        sysfs_write(saved[i]->path, saved[i]->value);
+}
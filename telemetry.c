@@ -0,0 +1,154 @@
+/* Telemetry: a record of every sample, for working out afterwards how
+ * throttling affected the jobs' progress.
+ *
+ * Each record carries the time, every temperature and fan reading, the
+ * throttling state and share, and the CPU time the jobs have used so far:
+ * from the cgroup's cpu.stat in cgroup mode, else summed over the
+ * processes in the jobs' process groups plus the jobs already reaped.
+ * Records are JSON objects, one per line, or CSV rows under a header line.
+ * Output is fully buffered, so the sampling loop never waits on it; it is
+ * flushed when full and at exit.
+ */
+#include "krun.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TELEMETRY_BUFSIZE 65536
+
+static FILE* out = (FILE*)NULL;
+static telemetry_format_t format;
+static struct timespec start;
+
+/* dest is a file to create, or "fd:N" for an already open descriptor */
+void telemetry_open(const char* dest, telemetry_format_t fmt) {
+    int i;
+
+    if (strncmp(dest, "fd:", 3) == 0)
+        out = fdopen(atoi(dest + 3), "w");
+    else
+        out = fopen(dest, "w");
+    if (out == (FILE*)NULL) {
+        fprintf(stderr, "Unable to open telemetry output '%s': %s\n",
+                dest, strerror(errno));
+        exit(-1);
+    }
+    setvbuf(out, (char*)NULL, _IOFBF, TELEMETRY_BUFSIZE);
+    format = fmt;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (format != TELEMETRY_CSV)
+        return;
+    fprintf(out, "time,elapsed");
+    for (i = 0; i < num_temperature_features; ++i)
+        fprintf(out, ",%s:%s", temperature_features[i].chip_name,
+                temperature_features[i].feature_name);
+    for (i = 0; i < num_fan_features; ++i)
+        fprintf(out, ",%s:%s", fan_features[i].chip_name,
+                fan_features[i].feature_name);
+    fprintf(out, ",state,share,jobs,cpu\n");
+}
+
+/* The user+system time of a process and its reaped children, in clock
+ * ticks, if it is in one of the jobs' process groups; else -1. Fields of
+ * /proc/<pid>/stat after "(comm)": state, ppid, pgrp, then utime, stime,
+ * cutime and cstime as the 11th to 14th. */
+static long group_ticks(const char* pid) {
+    char path[64], buf[1024], *p;
+    long pgrp, utime, stime, cutime, cstime;
+    FILE* fp;
+
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    fp = fopen(path, "r");
+    if (fp == (FILE*)NULL)
+        return -1;
+    p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (p == (char*)NULL || (p = strrchr(buf, ')')) == (char*)NULL)
+        return -1;
+    if (sscanf(p + 1, " %*c %*d %ld %*d %*d %*d %*u %*u %*u %*u %*u"
+            " %ld %ld %ld %ld", &pgrp, &utime, &stime, &cutime, &cstime) != 5)
+        return -1;
+    if (job_find((pid_t)pgrp) == (job_t*)NULL)
+        return -1;
+    return utime + stime + cutime + cstime;
+}
+
+/* CPU seconds used by the jobs so far */
+static double jobs_cpu_time(void) {
+    struct rusage ru;
+    struct dirent* de;
+    double usec;
+    long ticks = 0, t;
+    DIR* dir;
+
+    usec = cgroup_cpu_usage();
+    if (usec >= 0.0)
+        return usec / 1e6;
+    dir = opendir("/proc");
+    if (dir != (DIR*)NULL) {
+        while ((de = readdir(dir)) != (struct dirent*)NULL) {
+            if (de->d_name[0] >= '0' && de->d_name[0] <= '9'
+                    && (t = group_ticks(de->d_name)) > 0)
+                ticks += t;
+        }
+        closedir(dir);
+    }
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return (double)ticks / sysconf(_SC_CLK_TCK)
+            + ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+            + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Write one record. Temperatures are taken from the last detect_temp();
+ * fans are read now. */
+void telemetry_record(const char* state, double share) {
+    struct timespec now, mono;
+    double elapsed, cpu;
+    int i;
+
+    if (out == (FILE*)NULL)
+        return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    elapsed = (mono.tv_sec - start.tv_sec)
+            + (mono.tv_nsec - start.tv_nsec) / 1e9;
+    detect_fan();
+    cpu = jobs_cpu_time();
+
+    if (format == TELEMETRY_CSV) {
+        fprintf(out, "%ld.%03ld,%.3f", (long)now.tv_sec,
+                now.tv_nsec / 1000000, elapsed);
+        for (i = 0; i < num_temperature_features; ++i)
+            fprintf(out, ",%.1f", temperature_features[i].value);
+        for (i = 0; i < num_fan_features; ++i)
+            fprintf(out, ",%.0f", fan_features[i].value);
+        fprintf(out, ",%s,%.2f,%d,%.3f\n", state, share, num_jobs, cpu);
+        return;
+    }
+    fprintf(out, "{\"time\":%ld.%03ld,\"elapsed\":%.3f,\"temp\":{",
+            (long)now.tv_sec, now.tv_nsec / 1000000, elapsed);
+    for (i = 0; i < num_temperature_features; ++i)
+        fprintf(out, "%s\"%s:%s\":%.1f", i ? "," : "",
+                temperature_features[i].chip_name,
+                temperature_features[i].feature_name,
+                temperature_features[i].value);
+    fprintf(out, "},\"fan\":{");
+    for (i = 0; i < num_fan_features; ++i)
+        fprintf(out, "%s\"%s:%s\":%.0f", i ? "," : "",
+                fan_features[i].chip_name, fan_features[i].feature_name,
+                fan_features[i].value);
+    fprintf(out, "},\"state\":\"%s\",\"share\":%.2f,\"jobs\":%d,"
+            "\"cpu\":%.3f}\n", state, share, num_jobs, cpu);
+}
+
+void telemetry_close(void) {
+    if (out == (FILE*)NULL)
+        return;
+    fclose(out);
+    out = (FILE*)NULL;
+}
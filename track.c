@@ -0,0 +1,343 @@
+/* Tracking every descendant of the jobs.
+ *
+ * Signalling a job's process group misses any descendant that has moved
+ * to a session or process group of its own, such as a daemonised test
+ * server. With tracking, krun becomes a child subreaper, so orphaned
+ * descendants are reparented to it rather than to init, and follows
+ * fork and exit events from the proc connector to keep the set of all
+ * its descendants (and, under krund, those of the registered jobs);
+ * suspend and resume then signal every one of them.
+ *
+ * The connector reports every process on the machine, so the set is a
+ * hash table and each event costs one lookup. If events are lost to a
+ * full socket buffer, or the connector is not available (it needs
+ * CAP_NET_ADMIN), the set is rebuilt from /proc instead: after an
+ * overflow, or before each signal.
+ */
+#define _GNU_SOURCE
+#include "krun.h"
+#include <dirent.h>
+#include <errno.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define TRACK_RCVBUF (4 * 1024 * 1024)
+#define EMPTY 0
+#define TOMB (-1)
+
+/* open addressing; the roots are krun itself and, under krund, the
+ * registered jobs */
+static pid_t* table = (pid_t*)NULL;
+static int table_size = 0, table_used = 0, table_tombs = 0;
+static pid_t* roots = (pid_t*)NULL;
+static int num_roots = 0;
+static int nl_fd = -1;
+static int tracking = 0;
+
+/* Only forks and exits matter, but exec, uid changes and the rest arrive
+ * too; drop them in the kernel rather than waking for each. BPF loads
+ * are big-endian, the event host order. */
+static struct sock_filter filter_code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, NLMSG_LENGTH(0)
+            + offsetof(struct cn_msg, data) + offsetof(struct proc_event, what)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),  /* patched: FORK */
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0),  /* patched: EXIT */
+    BPF_STMT(BPF_RET | BPF_K, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+};
+static struct sock_fprog filter = {
+    sizeof(filter_code) / sizeof(filter_code[0]), filter_code
+};
+
+static unsigned hash(pid_t pid) {
+    return (unsigned)pid * 2654435761u;
+}
+
+static void insert(pid_t pid);
+
+static void resize(int size) {
+    pid_t* old = table;
+    int i, old_size = table_size;
+
+    table = calloc(size, sizeof(pid_t));
+    if (table == (pid_t*)NULL) {
+        fprintf(stderr, "Out of memory for process table\n");
+        exit(-1);
+    }
+    table_size = size;
+    table_used = table_tombs = 0;
+    for (i = 0; i < old_size; ++i) {
+        if (old[i] > 0)
+            insert(old[i]);
+    }
+    free(old);
+}
+
+static int slot(pid_t pid) {
+    unsigned i = hash(pid) & (table_size - 1);
+
+    while (table[i] != EMPTY && table[i] != pid)
+        i = (i + 1) & (table_size - 1);
+    return i;
+}
+
+static void insert(pid_t pid) {
+    unsigned i;
+
+    if ((table_used + table_tombs + 1) * 2 > table_size)
+        resize(table_used * 4 > table_size ? table_size * 2 : table_size);
+    i = hash(pid) & (table_size - 1);
+    while (table[i] > 0 && table[i] != pid)
+        i = (i + 1) & (table_size - 1);
+    if (table[i] == pid)
+        return;
+    if (table[i] == TOMB)
+        --table_tombs;
+    table[i] = pid;
+    ++table_used;
+}
+
+static int contains(pid_t pid) {
+    return table_size > 0 && table[slot(pid)] == pid;
+}
+
+static void erase(pid_t pid) {
+    int i;
+
+    if (table_size == 0)
+        return;
+    i = slot(pid);
+    if (table[i] != pid)
+        return;
+    table[i] = TOMB;
+    --table_used;
+    ++table_tombs;
+}
+
+/* Start tracking: become a subreaper, track our own descendants, and
+ * listen for process events. Returns the fd to watch for them, or -1 if
+ * the connector is not available. */
+int track_init(void) {
+    struct sockaddr_nl sa;
+    struct {
+        struct nlmsghdr nl;
+        struct cn_msg cn;
+        enum proc_cn_mcast_op op;
+    } __attribute__((packed)) msg;
+    int size = TRACK_RCVBUF;
+
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) != 0)
+        fprintf(stderr, "Could not become a subreaper, errno %d (%s)\n",
+                errno, strerror(errno));
+    tracking = 1;
+    resize(1024);
+    filter_code[1].k = htonl(PROC_EVENT_FORK);
+    filter_code[2].k = htonl(PROC_EVENT_EXIT);
+    track_add(getpid());
+
+    nl_fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            NETLINK_CONNECTOR);
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = CN_IDX_PROC;
+    sa.nl_pid = 0;
+    memset(&msg, 0, sizeof(msg));
+    msg.nl.nlmsg_len = sizeof(msg);
+    msg.nl.nlmsg_type = NLMSG_DONE;
+    msg.nl.nlmsg_pid = getpid();
+    msg.cn.id.idx = CN_IDX_PROC;
+    msg.cn.id.val = CN_VAL_PROC;
+    msg.cn.len = sizeof(msg.op);
+    msg.op = PROC_CN_MCAST_LISTEN;
+    if (nl_fd < 0 || bind(nl_fd, (struct sockaddr*)&sa, sizeof(sa)) != 0
+            || send(nl_fd, &msg, sizeof(msg), 0) != sizeof(msg)) {
+        fprintf(stderr, "Could not listen for process events, errno %d (%s);"
+                " tracking through /proc instead\n", errno, strerror(errno));
+        if (nl_fd >= 0)
+            close(nl_fd);
+        nl_fd = -1;
+        return -1;
+    }
+    /* needs CAP_NET_ADMIN beyond rmem_max, so a plain SO_RCVBUF may do */
+    if (setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0)
+        setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (setsockopt(nl_fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter,
+            sizeof(filter)) != 0)
+        fprintf(stderr, "Could not filter process events, errno %d (%s)\n",
+                errno, strerror(errno));
+    return nl_fd;
+}
+
+/* track pid and everything it forks from now on */
+void track_add(pid_t pid) {
+    if (!tracking)
+        return;
+    roots = realloc(roots, (num_roots + 1) * sizeof(pid_t));
+    roots[num_roots++] = pid;
+    insert(pid);
+}
+
+/* Rebuild the set from /proc: the roots and all their descendants. */
+void track_rescan(void) {
+    char path[64], buf[512], *p;
+    struct dirent* de;
+    pid_t* pids = (pid_t*)NULL;
+    pid_t* ppids = (pid_t*)NULL;
+    int n = 0, size = 0, i, added;
+    long pid, ppid;
+    DIR* dir;
+    FILE* fp;
+
+    if (!tracking)
+        return;
+    dir = opendir("/proc");
+    if (dir == (DIR*)NULL)
+        return;
+    while ((de = readdir(dir)) != (struct dirent*)NULL) {
+        if (de->d_name[0] < '0' || de->d_name[0] > '9')
+            continue;
+        snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+        fp = fopen(path, "r");
+        if (fp == (FILE*)NULL)
+            continue;
+        p = fgets(buf, sizeof(buf), fp);
+        fclose(fp);
+        if (p == (char*)NULL || (p = strrchr(buf, ')')) == (char*)NULL
+                || sscanf(p + 1, " %*c %ld", &ppid) != 1)
+            continue;
+        pid = atol(de->d_name);
+        if (n == size) {
+            size = size ? size * 2 : 1024;
+            pids = realloc(pids, size * sizeof(pid_t));
+            ppids = realloc(ppids, size * sizeof(pid_t));
+        }
+        pids[n] = (pid_t)pid;
+        ppids[n++] = (pid_t)ppid;
+    }
+    closedir(dir);
+
+    free(table);
+    table = (pid_t*)NULL;
+    table_size = 0;
+    resize(1024);
+    for (i = 0; i < num_roots; ++i)
+        insert(roots[i]);
+    /* /proc is in pid order, not tree order, so repeat until settled */
+    do {
+        added = 0;
+        for (i = 0; i < n; ++i) {
+            if (!contains(pids[i]) && contains(ppids[i])) {
+                insert(pids[i]);
+                added = 1;
+            }
+        }
+    } while (added);
+    free(pids);
+    free(ppids);
+}
+
+/* Take in the pending process events. */
+void track_read(void) {
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr* nlh;
+    struct cn_msg* cn;
+    struct proc_event* ev;
+    ssize_t len;
+
+    while ((len = recv(nl_fd, buf, sizeof(buf), 0)) != 0) {
+        if (len < 0) {
+            if (errno == ENOBUFS)
+                track_rescan();     /* events were lost */
+            if (errno == EINTR || errno == ENOBUFS)
+                continue;
+            return;
+        }
+        for (nlh = (struct nlmsghdr*)buf; NLMSG_OK(nlh, len);
+                nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != NLMSG_DONE)
+                continue;
+            cn = (struct cn_msg*)NLMSG_DATA(nlh);
+            ev = (struct proc_event*)cn->data;
+            if (ev->what == PROC_EVENT_FORK) {
+                /* a new thread shares its process's tgid */
+                if (ev->event_data.fork.child_pid
+                        == ev->event_data.fork.child_tgid
+                        && contains(ev->event_data.fork.parent_tgid))
+                    insert(ev->event_data.fork.child_tgid);
+            } else if (ev->what == PROC_EVENT_EXIT) {
+                if (ev->event_data.exit.process_pid
+                        == ev->event_data.exit.process_tgid)
+                    erase(ev->event_data.exit.process_tgid);
+            }
+        }
+    }
+}
+
+/* Stop tracking the job rooted at pid, first sending sig (if nonzero)
+ * to its descendants. */
+void track_remove(pid_t pid, int sig) {
+    pid_t* saved = roots;
+    int i, saved_num = num_roots;
+
+    for (i = 0; i < num_roots && roots[i] != pid; ++i)
+        ;
+    if (i == num_roots)
+        return;
+    if (sig) {
+        roots = &pid;
+        num_roots = 1;
+        track_rescan();
+        track_signal(sig);
+        roots = saved;
+        num_roots = saved_num;
+    }
+    roots[i] = roots[--num_roots];
+    track_rescan();
+}
+
+int track_active(void) {
+    return tracking;
+}
+
+/* call fn on every tracked process other than krun itself */
+void track_each(job_task_fn fn, void* arg) {
+    pid_t self = getpid();
+    int i;
+
+    if (!tracking)
+        return;
+    if (nl_fd < 0)
+        track_rescan();
+    for (i = 0; i < table_size; ++i) {
+        if (table[i] > 0 && table[i] != self)
+            fn(table[i], arg);
+    }
+}
+
+static void signal_fn(pid_t pid, void* arg) {
+    if (kill(pid, *(int*)arg) != 0 && errno != ESRCH)
+        fprintf(stderr, "Tried to send signal %d to pid %ld, errno %d\n",
+                *(int*)arg, (long)pid, errno);
+}
+
+/* send sig to every tracked descendant */
+void track_signal(int sig) {
+    track_each(signal_fn, &sig);
+}
+
+void track_cleanup(void) {
+    if (nl_fd >= 0)
+        close(nl_fd);
+    nl_fd = -1;
+}